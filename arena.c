@@ -0,0 +1,117 @@
+/**
+ * \file arena.c
+ * Region based memory allocation.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "xmalloc.h"
+
+
+#define ARENA_BLOCK_SIZE	4096	/**< default size of the regular blocks */
+
+/** Strictest alignment of the basic types */
+typedef union {
+	long l;
+	double d;
+	void *p;
+	void (*f)(void);
+} arena_align_t;
+
+#define ARENA_ALIGN(size) \
+	(((size) + sizeof(arena_align_t) - 1) & ~(sizeof(arena_align_t) - 1))
+
+struct arena_block {
+	arena_block_t *next;
+	size_t size;		/**< usable bytes after the header */
+	size_t used;
+};
+
+#define ARENA_HEADER	ARENA_ALIGN(sizeof(arena_block_t))
+
+
+static arena_block_t *arena_block_new(size_t size)
+{
+	arena_block_t *block;
+
+	block = (arena_block_t *)xmalloc(ARENA_HEADER + size);
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+arena_t *arena_new(void)
+{
+	arena_t *arena;
+
+	arena = (arena_t *)xmalloc(sizeof(arena_t));
+
+	arena->blocks = NULL;
+	arena->block_size = ARENA_BLOCK_SIZE - ARENA_HEADER;
+
+	return arena;
+}
+
+void arena_free(arena_t *arena)
+{
+	arena_block_t *block, *next;
+
+	for(block = arena->blocks; block; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+
+	free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+	arena_block_t *block = arena->blocks;
+	void *ptr;
+
+	size = ARENA_ALIGN(size ? size : 1);
+
+	if(!block || block->size - block->used < size)
+	{
+		if(size > arena->block_size / 4)
+		{
+			/* Large allocations get a block of their own, kept behind
+			 * the current one so that its free space isn't wasted */
+			block = arena_block_new(size);
+			if(arena->blocks)
+			{
+				block->next = arena->blocks->next;
+				arena->blocks->next = block;
+			}
+			else
+				arena->blocks = block;
+		}
+		else
+		{
+			block = arena_block_new(arena->block_size);
+			block->next = arena->blocks;
+			arena->blocks = block;
+		}
+	}
+
+	assert(block->size - block->used >= size);
+
+	ptr = (char *)block + ARENA_HEADER + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+char *arena_strdup(arena_t *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return (char *)memcpy(arena_alloc(arena, len), s, len);
+}
@@ -0,0 +1,41 @@
+/**
+ * \file arena.h
+ * Region based memory allocation.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+
+#include <stddef.h>
+
+
+typedef struct arena_block arena_block_t;
+
+/**
+ * A memory arena.
+ *
+ * Allocations are carved out of large blocks by bumping a pointer and can't
+ * be freed individually; instead everything allocated from the arena is
+ * released at once by arena_free().  This suits objects sharing a lifetime,
+ * such as the recipients of a message or the identities of the
+ * configuration.
+ */
+typedef struct {
+	arena_block_t *blocks;	/**< current block first */
+	size_t block_size;	/**< size of the regular blocks */
+} arena_t;
+
+/** Create a new arena. */
+arena_t *arena_new(void);
+
+/** Free an arena, with everything allocated from it. */
+void arena_free(arena_t *arena);
+
+/** Allocate memory suitably aligned for any kind of object, or die. */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/** Duplicate a string into the arena. */
+char *arena_strdup(arena_t *arena, const char *s);
+
+#endif
@@ -0,0 +1,104 @@
+/**
+ * \file domain.c
+ * Mapping of domain names and domain patterns to values.
+ */
+
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "domain.h"
+#include "xmalloc.h"
+
+
+domain_map_t *domain_map_new(void)
+{
+	domain_map_t *map;
+
+	map = (domain_map_t *)xmalloc(sizeof(domain_map_t));
+
+	map->exact = hash_new();
+	map->suffix = hash_new();
+	map->fallback = NULL;
+
+	return map;
+}
+
+void domain_map_free(domain_map_t *map)
+{
+	hash_free(map->exact);
+	hash_free(map->suffix);
+	free(map);
+}
+
+/** Lowercase copy of a domain, without any trailing dot */
+static char *domain_normalize(const char *domain)
+{
+	char *key, *p;
+	size_t len;
+
+	key = xstrdup(domain);
+	for (p = key; *p; p++)
+		*p = tolower((unsigned char)*p);
+
+	len = p - key;
+	if (len && key[len - 1] == '.')
+		key[len - 1] = '\0';
+
+	return key;
+}
+
+int domain_map_add(domain_map_t *map, const char *pattern, void *value)
+{
+	hash_t *hash;
+	char *key;
+	int ret;
+
+	if (!strcmp(pattern, "*"))
+	{
+		if (map->fallback)
+			return 0;
+		map->fallback = value;
+		return 1;
+	}
+
+	if (!strncmp(pattern, "*.", 2))
+	{
+		hash = map->suffix;
+		pattern += 2;
+	}
+	else if (pattern[0] == '.')
+	{
+		hash = map->suffix;
+		pattern += 1;
+	}
+	else
+		hash = map->exact;
+
+	key = domain_normalize(pattern);
+	ret = hash_insert(hash, key, value);
+	free(key);
+
+	return ret;
+}
+
+void *domain_map_lookup(domain_map_t *map, const char *domain)
+{
+	char *key;
+	const char *p;
+	void *value;
+
+	key = domain_normalize(domain);
+
+	if (!(value = hash_lookup(map->exact, key)))
+	{
+		/* The nearest parent first */
+		for (p = strchr(key, '.'); p && !value; p = strchr(p + 1, '.'))
+			value = hash_lookup(map->suffix, p + 1);
+	}
+
+	free(key);
+
+	return value ? value : map->fallback;
+}
@@ -0,0 +1,44 @@
+/**
+ * \file domain.h
+ * Mapping of domain names and domain patterns to values.
+ */
+
+#ifndef _DOMAIN_H
+#define _DOMAIN_H
+
+
+#include "hash.h"
+
+
+/**
+ * A domain map.
+ *
+ * Patterns are either a domain name, matching only that domain, a domain
+ * prefixed by "*." or ".", matching any of its subdomains, or "*", matching
+ * any domain.  Lookups return the value of the most specific pattern, by
+ * probing the domain and then each of its parent domains in turn.
+ */
+typedef struct {
+	hash_t *exact;		/**< domains */
+	hash_t *suffix;		/**< parents of the matched subdomains */
+	void *fallback;		/**< value for "*" */
+} domain_map_t;
+
+/** Create a new domain map. */
+domain_map_t *domain_map_new(void);
+
+/** Free a domain map (but not its values). */
+void domain_map_free(domain_map_t *map);
+
+/**
+ * Add a pattern.
+ *
+ * \return zero if the pattern was already present, in which case its value is
+ * left untouched.
+ */
+int domain_map_add(domain_map_t *map, const char *pattern, void *value);
+
+/** Lookup the value of the most specific pattern matching a domain. */
+void *domain_map_lookup(domain_map_t *map, const char *domain);
+
+#endif
@@ -0,0 +1,176 @@
+/**
+ * \file hash.c
+ * Simple string keyed hash table.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "xmalloc.h"
+
+
+#define HASH_INITIAL_SIZE	64	/**< initial number of buckets */
+
+
+unsigned hash_string(const char *s)
+{
+	unsigned h = 2166136261U;
+
+	while(*s)
+	{
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static void hash_alloc_buckets(hash_t *hash, unsigned size)
+{
+	unsigned i;
+
+	if(hash->arena)
+		hash->buckets = (struct list_head *)arena_alloc(hash->arena, size * sizeof(struct list_head));
+	else
+		hash->buckets = (struct list_head *)xmalloc(size * sizeof(struct list_head));
+	for(i = 0; i < size; i++)
+		INIT_LIST_HEAD(&hash->buckets[i]);
+	hash->size = size;
+}
+
+hash_t *hash_new(void)
+{
+	hash_t *hash;
+
+	hash = (hash_t *)xmalloc(sizeof(hash_t));
+
+	memset(hash, 0, sizeof(hash_t));
+
+	hash_alloc_buckets(hash, HASH_INITIAL_SIZE);
+
+	return hash;
+}
+
+hash_t *hash_new_arena(arena_t *arena)
+{
+	hash_t *hash;
+
+	hash = (hash_t *)arena_alloc(arena, sizeof(hash_t));
+
+	memset(hash, 0, sizeof(hash_t));
+	hash->arena = arena;
+
+	hash_alloc_buckets(hash, HASH_INITIAL_SIZE);
+
+	return hash;
+}
+
+void hash_free(hash_t *hash)
+{
+	unsigned i;
+
+	assert(!hash->arena);
+
+	for(i = 0; i < hash->size; i++)
+	{
+		struct list_head *ptr, *tmp;
+
+		list_for_each_safe(ptr, tmp, &hash->buckets[i])
+		{
+			hash_entry_t *entry = list_entry(ptr, hash_entry_t, list);
+
+			list_del(ptr);
+			free(entry->key);
+			free(entry);
+		}
+	}
+
+	free(hash->buckets);
+	free(hash);
+}
+
+/** Double the number of buckets, keeping the average chain length short. */
+static void hash_grow(hash_t *hash)
+{
+	struct list_head *old_buckets = hash->buckets;
+	unsigned old_size = hash->size, i;
+
+	hash_alloc_buckets(hash, old_size << 1);
+
+	for(i = 0; i < old_size; i++)
+	{
+		struct list_head *ptr, *tmp;
+
+		list_for_each_safe(ptr, tmp, &old_buckets[i])
+		{
+			hash_entry_t *entry = list_entry(ptr, hash_entry_t, list);
+
+			list_add(ptr, &hash->buckets[entry->hash & (hash->size - 1)]);
+		}
+	}
+
+	if(!hash->arena)
+		free(old_buckets);
+}
+
+static hash_entry_t *hash_find(hash_t *hash, const char *key, unsigned h)
+{
+	struct list_head *ptr;
+
+	list_for_each(ptr, &hash->buckets[h & (hash->size - 1)])
+	{
+		hash_entry_t *entry = list_entry(ptr, hash_entry_t, list);
+
+		if(entry->hash == h && !strcmp(entry->key, key))
+			return entry;
+	}
+
+	return NULL;
+}
+
+void *hash_lookup(hash_t *hash, const char *key)
+{
+	hash_entry_t *entry;
+
+	assert(key);
+
+	entry = hash_find(hash, key, hash_string(key));
+
+	return entry ? entry->value : NULL;
+}
+
+int hash_insert(hash_t *hash, const char *key, void *value)
+{
+	hash_entry_t *entry;
+	unsigned h;
+
+	assert(key);
+
+	h = hash_string(key);
+	if(hash_find(hash, key, h))
+		return 0;
+
+	if(hash->count >= hash->size)
+		hash_grow(hash);
+
+	if(hash->arena)
+	{
+		entry = (hash_entry_t *)arena_alloc(hash->arena, sizeof(hash_entry_t));
+		entry->key = (char *)key;
+	}
+	else
+	{
+		entry = (hash_entry_t *)xmalloc(sizeof(hash_entry_t));
+		entry->key = xstrdup(key);
+	}
+	entry->hash = h;
+	entry->value = value;
+
+	list_add(&entry->list, &hash->buckets[h & (hash->size - 1)]);
+	hash->count++;
+
+	return 1;
+}
@@ -0,0 +1,64 @@
+/**
+ * \file hash.h
+ * Simple string keyed hash table.
+ */
+
+#ifndef _HASH_H
+#define _HASH_H
+
+
+#include "arena.h"
+#include "list.h"
+
+
+/**
+ * Item of a hash table bucket.
+ */
+typedef struct {
+	struct list_head list;
+	unsigned hash;		/**< cached hash value of the key */
+	char *key;
+	void *value;
+} hash_entry_t;
+
+/**
+ * A hash table.
+ *
+ * Keys are copied on insertion, unless in an arena, and compared exactly, so
+ * callers wanting case-insensitive semantics should normalize the keys first.
+ */
+typedef struct {
+	struct list_head *buckets;
+	unsigned size;		/**< number of buckets, always a power of two */
+	unsigned count;		/**< number of entries */
+	arena_t *arena;		/**< where everything comes from, or NULL */
+} hash_t;
+
+/** Hash a string (FNV-1a). */
+unsigned hash_string(const char *s);
+
+/** Create a new hash table. */
+hash_t *hash_new(void);
+
+/**
+ * Create a new hash table in an arena, released along with it rather than by
+ * hash_free().  Its keys aren't copied but must last as long as the arena,
+ * e.g., by being allocated from it too.
+ */
+hash_t *hash_new_arena(arena_t *arena);
+
+/** Free a hash table and its keys (but not its values). */
+void hash_free(hash_t *hash);
+
+/** Lookup a key, returning its value or NULL if not found. */
+void *hash_lookup(hash_t *hash, const char *key);
+
+/**
+ * Insert a key.
+ *
+ * \return zero if the key was already present, in which case its value is
+ * left untouched.
+ */
+int hash_insert(hash_t *hash, const char *key, void *value);
+
+#endif
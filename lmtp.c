@@ -0,0 +1,408 @@
+/**
+ * \file lmtp.c
+ * Local delivery via LMTP (RFC 2033).
+ *
+ * LMTP servers are required to support pipelining, so the whole envelope is
+ * sent at once and the replies are read afterwards.  After the data a reply
+ * is given for each accepted recipient.
+ */
+
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "lmtp.h"
+#include "local.h"
+#include "main.h"
+#include "xmalloc.h"
+
+#ifndef MAXHOSTNAMELEN
+#define MAXHOSTNAMELEN 256
+#endif
+
+
+char *lmtp = NULL;
+
+/** \name Connection state */
+/*@{*/
+static FILE *lmtp_in = NULL;	/**< replies from the server */
+static FILE *lmtp_out = NULL;	/**< commands to the server */
+static pid_t lmtp_pid = 0;	/**< server process, if spawned */
+static char lmtp_host[MAXHOSTNAMELEN];	/**< ours, as said in LHLO */
+/*@}*/
+
+#define LMTP_LINE	1024	/**< maximum reply line length */
+
+
+/** Connect to a Unix domain socket */
+static int lmtp_connect(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+	{
+		fprintf(stderr, "LMTP socket path too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+	{
+		fprintf(stderr, "connect: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/** Spawn a command speaking LMTP on its standard input and output */
+static int lmtp_spawn(const char *command)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+	{
+		perror("socketpair");
+		return -1;
+	}
+
+	if ((lmtp_pid = fork()) < 0)
+	{
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (lmtp_pid == 0)
+	{
+		close(sv[0]);
+		dup2(sv[1], STDIN_FILENO);
+		dup2(sv[1], STDOUT_FILENO);
+		close(sv[1]);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+
+	close(sv[1]);
+
+	return sv[0];
+}
+
+/**
+ * Read a (possibly multi-line) reply.
+ *
+ * \return the reply code, or -1 if the connection was lost.
+ */
+static int lmtp_reply(char *line, size_t size)
+{
+	do {
+		if (!fgets(line, size, lmtp_in))
+		{
+			strcpy(line, "Connection lost\n");
+			return -1;
+		}
+
+		if (log_fp)
+		{
+			fputs("S: ", log_fp);
+			fputs(line, log_fp);
+		}
+
+		if (strlen(line) < 4)
+			return -1;
+	} while (line[3] == '-');
+
+	return atoi(line);
+}
+
+static void lmtp_command(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(lmtp_out, format, ap);
+	va_end(ap);
+	fputs("\r\n", lmtp_out);
+
+	if (log_fp)
+	{
+		fputs("C: ", log_fp);
+		va_start(ap, format);
+		vfprintf(log_fp, format, ap);
+		va_end(ap);
+		fputc('\n', log_fp);
+	}
+}
+
+void lmtp_close(void)
+{
+	if (lmtp_out)
+	{
+		char line[LMTP_LINE];
+
+		lmtp_command("QUIT");
+		fflush(lmtp_out);
+		lmtp_reply(line, sizeof(line));
+
+		fclose(lmtp_out);
+		fclose(lmtp_in);
+		lmtp_out = lmtp_in = NULL;
+
+		if (verbose)
+			fputs("Disconnected to LMTP server\n", stdout);
+	}
+
+	if (lmtp_pid > 0)
+	{
+		waitpid(lmtp_pid, NULL, 0);
+		lmtp_pid = 0;
+	}
+}
+
+/** Drop a broken connection without the QUIT dialogue */
+static void lmtp_abort(void)
+{
+	if (lmtp_out)
+	{
+		fclose(lmtp_out);
+		fclose(lmtp_in);
+		lmtp_out = lmtp_in = NULL;
+	}
+
+	if (lmtp_pid > 0)
+	{
+		kill(lmtp_pid, SIGTERM);
+		waitpid(lmtp_pid, NULL, 0);
+		lmtp_pid = 0;
+	}
+}
+
+/** Open the connection and say LHLO, unless already done */
+static int lmtp_open(void)
+{
+	char line[LMTP_LINE];
+	struct sigaction sa;
+	int fd;
+
+	if (lmtp_out)
+		return 0;
+
+	/* Don't get killed by a server closing its side, see smtp_send() */
+	sa.sa_handler = SIG_IGN; sigemptyset (&sa.sa_mask); sa.sa_flags = 0;
+	sigaction (SIGPIPE, &sa, NULL);
+
+	if (lmtp[0] == '|')
+		fd = lmtp_spawn(lmtp + 1);
+	else
+		fd = lmtp_connect(lmtp);
+	if (fd < 0)
+		return -1;
+
+	if (!(lmtp_in = fdopen(fd, "r")) || !(lmtp_out = fdopen(dup(fd), "w")))
+	{
+		perror(NULL);
+		exit(EX_OSERR);
+	}
+
+	if (verbose)
+		fprintf(stdout, "Connected to LMTP server: %s\n", lmtp);
+
+	if (lmtp_reply(line, sizeof(line)) / 100 != 2)
+		goto failure;
+
+	if (gethostname(lmtp_host, sizeof(lmtp_host)))
+		strcpy(lmtp_host, "localhost");
+	lmtp_host[sizeof(lmtp_host) - 1] = '\0';
+
+	lmtp_command("LHLO %s", lmtp_host);
+	fflush(lmtp_out);
+	if (lmtp_reply(line, sizeof(line)) / 100 != 2)
+		goto failure;
+
+	return 0;
+
+failure:
+	fprintf(stderr, "LMTP server problem: %s", line);
+	lmtp_abort();
+	return -1;
+}
+
+/**
+ * Send the message data, converting newlines to CRLF and dot-stuffing.
+ */
+static void lmtp_data(FILE *fp)
+{
+	char buffer[BUFSIZ];
+	int bol = 1, cr = 0;
+	size_t n, i;
+
+	rewind(fp);
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		for (i = 0; i < n; i++)
+		{
+			char c = buffer[i];
+
+			if (bol && c == '.')
+				putc('.', lmtp_out);
+
+			if (c == '\n' && !cr)
+				putc('\r', lmtp_out);
+
+			putc(c, lmtp_out);
+
+			bol = c == '\n';
+			cr = c == '\r';
+		}
+
+	if (!bol)
+		fputs("\r\n", lmtp_out);
+	fputs(".\r\n", lmtp_out);
+}
+
+int lmtp_deliver(message_t *message, FILE *fp)
+{
+	char line[LMTP_LINE];
+	struct list_head *ptr;
+	recipient_t **recipients;
+	int nrecipients = 0, naccepted = 0, failures = 0, code, i;
+
+	list_for_each(ptr, &message->local_recipients)
+		nrecipients++;
+
+	if (force_mda)
+		nrecipients = 1;
+
+	if (lmtp_open() < 0)
+		return nrecipients;
+
+	/* Envelope, pipelined */
+	lmtp_command("MAIL FROM:<%s>", message->reverse_path ? message->reverse_path : "");
+	if (force_mda)
+		lmtp_command("RCPT TO:<%s>", force_mda);
+	else
+		list_for_each(ptr, &message->local_recipients)
+		{
+			recipient_t *recipient = list_entry(ptr, recipient_t, list);
+
+			/* A path needs a domain, this host's for a bare user */
+			if (strchr(recipient->address, '@'))
+				lmtp_command("RCPT TO:<%s>", recipient->address);
+			else
+				lmtp_command("RCPT TO:<%s@%s>", recipient->address, lmtp_host);
+		}
+	lmtp_command("DATA");
+	fflush(lmtp_out);
+
+	if ((code = lmtp_reply(line, sizeof(line))) / 100 != 2)
+	{
+		fprintf(stderr, "LMTP server problem: %s", line);
+		if (code < 0)
+		{
+			lmtp_abort();
+			return nrecipients;
+		}
+	}
+
+	/* Remember which recipients were accepted, as each gets a reply */
+	recipients = (recipient_t **)xmalloc(nrecipients * sizeof(recipient_t *));
+	ptr = message->local_recipients.next;
+	for (i = 0; i < nrecipients; i++, ptr = ptr->next)
+	{
+		const char *address = force_mda ? force_mda :
+			list_entry(ptr, recipient_t, list)->address;
+
+		if ((code = lmtp_reply(line, sizeof(line))) / 100 == 2)
+			recipients[naccepted++] = force_mda ? NULL : list_entry(ptr, recipient_t, list);
+		else
+		{
+			fprintf(stderr, "%s: %s", address, line);
+			failures++;
+			if (code < 0)
+				goto failure;
+		}
+	}
+
+	if ((code = lmtp_reply(line, sizeof(line))) != 354)
+	{
+		/* no recipients accepted, or the server refuses the data */
+		if (naccepted)
+			fprintf(stderr, "LMTP server problem: %s", line);
+		failures += naccepted;
+		if (code < 0)
+			goto failure;
+		if (naccepted)
+		{
+			lmtp_command("RSET");
+			fflush(lmtp_out);
+			lmtp_reply(line, sizeof(line));
+		}
+		free(recipients);
+		return failures;
+	}
+
+	lmtp_data(fp);
+	fflush(lmtp_out);
+
+	/* One reply per accepted recipient */
+	for (i = 0; i < naccepted; i++)
+	{
+		const char *address = recipients[i] ? recipients[i]->address : force_mda;
+
+		if ((code = lmtp_reply(line, sizeof(line))) / 100 != 2)
+		{
+			fprintf(stderr, "%s: %s", address, line);
+			failures++;
+			if (code < 0)
+			{
+				failures += naccepted - i - 1;
+				break;
+			}
+		}
+		else
+		{
+			if (recipients[i])
+				recipients[i]->delivered = 1;
+			else
+				/* the forced one stands for all of them */
+				list_for_each(ptr, &message->local_recipients)
+					list_entry(ptr, recipient_t, list)->delivered = 1;
+
+			if (verbose)
+				fprintf(stdout, "To %s: %s", address, line);
+		}
+	}
+
+	free(recipients);
+
+	if (code < 0)
+		lmtp_abort();
+
+	return failures;
+
+failure:
+	free(recipients);
+	lmtp_abort();
+	return nrecipients;
+}
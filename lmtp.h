@@ -0,0 +1,36 @@
+/**
+ * \file lmtp.h
+ * Local delivery via LMTP.
+ */
+
+#ifndef _LMTP_H
+#define _LMTP_H
+
+
+#include <stdio.h>
+
+#include "message.h"
+
+
+/**
+ * LMTP server: either the path of a Unix domain socket or, prefixed by a
+ * '|', a command speaking LMTP on its standard input and output.
+ */
+extern char *lmtp;
+
+/**
+ * Deliver a message to its local recipients via LMTP.
+ *
+ * The connection is opened on first use and kept open for subsequent
+ * messages until lmtp_close() is called.
+ *
+ * \param fp the message as given to the MDA, i.e. with bare newlines.
+ *
+ * \return the number of recipients for which delivery failed.
+ */
+int lmtp_deliver(message_t *message, FILE *fp);
+
+/** Close the LMTP connection, if any. */
+void lmtp_close(void);
+
+#endif
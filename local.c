@@ -4,39 +4,251 @@
  */
 
 
+#include "config.h"
+
 #include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_GETIFADDRS
+#include <ifaddrs.h>
+#endif
 
 #include "local.h"
 #include "main.h"
+#include "hash.h"
+#include "lmtp.h"
+#include "rcfile.h"
 #include "xmalloc.h"
 
+#ifndef MAXHOSTNAMELEN
+#define MAXHOSTNAMELEN 256
+#endif
+
 
 char *mda = NULL;
 char *force_mda = NULL;
+int local_resolve = 0;
 
 FILE *mda_fp = NULL;
 
 
-int local_address(const char *address)
+/**
+ * \name Local names
+ *
+ * Set of domain names and address literals which designate this host, built
+ * once per process the first time an address with a domain is classified.
+ * Remote domains looked up via the resolver are cached here as well.
+ */
+/*@{*/
+
+static char local_marker, remote_marker;
+
+#define LOCAL_NAME	((void *)&local_marker)
+#define REMOTE_NAME	((void *)&remote_marker)
+
+static hash_t *local_names = NULL;
+static int local_names_ready = 0;
+
+char **local_domains = NULL;
+static int nlocal_domains = 0;
+
+/** Lowercase copy of a domain, as used for the local names keys */
+static char *domain_key(const char *domain)
+{
+	char *key, *p;
+
+	key = xstrdup(domain);
+	for (p = key; *p; p++)
+		*p = tolower((unsigned char)*p);
+
+	return key;
+}
+
+static void local_name_add(const char *name, void *value)
 {
-	if (!force_mda)
+	char *key;
+
+	key = domain_key(name);
+	hash_insert(local_names, key, value);
+	free(key);
+}
+
+/** Add the address literal form ("[192.0.2.1]", "[ipv6:...]") of a socket address */
+static void local_name_add_sockaddr(const struct sockaddr *sa, void *value)
+{
+	char addr[INET6_ADDRSTRLEN], literal[INET6_ADDRSTRLEN + 8];
+
+	switch (sa->sa_family)
 	{
-		/* TODO:
-		 *
-		 * A litle more searching
-		 * Does the regex"[^@]*\@(.*)" resolve to 127.0.0.1 or a local ip?
-		 *
-		 * Maybe it should be delivered locally?
-		 */
-		return !strchr(address, '@');
+		case AF_INET:
+			if (!inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, addr, sizeof(addr)))
+				return;
+			snprintf(literal, sizeof(literal), "[%s]", addr);
+			break;
+
+		case AF_INET6:
+			if (!inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr, addr, sizeof(addr)))
+				return;
+			snprintf(literal, sizeof(literal), "[ipv6:%s]", addr);
+			break;
+
+		default:
+			return;
 	}
 
-	return 1;
+	local_name_add(literal, value);
+}
+
+static void local_names_init(void)
+{
+	char host[MAXHOSTNAMELEN];
+	struct addrinfo hints, *res, *ai;
+	int i;
+
+	local_names_ready = 1;
+	local_names = hash_new();
+
+	for (i = 0; i < nlocal_domains; i++)
+		local_name_add(local_domains[i], LOCAL_NAME);
+
+	/* Without a local transport, mail for this host goes to the relay */
+	if (!mda && !lmtp)
+		return;
+
+	local_name_add("localhost", LOCAL_NAME);
+
+	if (!gethostname(host, sizeof(host)))
+	{
+		host[sizeof(host) - 1] = '\0';
+		local_name_add(host, LOCAL_NAME);
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_CANONNAME;
+		if (!getaddrinfo(host, NULL, &hints, &res))
+		{
+			if (res->ai_canonname)
+				local_name_add(res->ai_canonname, LOCAL_NAME);
+			for (ai = res; ai; ai = ai->ai_next)
+				local_name_add_sockaddr(ai->ai_addr, LOCAL_NAME);
+			freeaddrinfo(res);
+		}
+	}
+
+#ifdef HAVE_GETIFADDRS
+	{
+		struct ifaddrs *ifap, *ifa;
+
+		if (!getifaddrs(&ifap))
+		{
+			for (ifa = ifap; ifa; ifa = ifa->ifa_next)
+				if (ifa->ifa_addr)
+					local_name_add_sockaddr(ifa->ifa_addr, LOCAL_NAME);
+			freeifaddrs(ifap);
+		}
+	}
+#endif
+}
+
+void local_domain_add(const char *domain)
+{
+	local_domains = (char **)xrealloc(local_domains, (nlocal_domains + 2) * sizeof(char *));
+	local_domains[nlocal_domains++] = arena_strdup(config_arena, domain);
+	local_domains[nlocal_domains] = NULL;
+}
+
+/** Whether a domain resolves to one of the addresses of this host */
+static int local_domain_resolves(const char *domain)
+{
+	struct addrinfo hints, *res, *ai;
+	int local = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(domain, NULL, &hints, &res))
+		return 0;
+
+	for (ai = res; ai && !local; ai = ai->ai_next)
+	{
+		char addr[INET6_ADDRSTRLEN], literal[INET6_ADDRSTRLEN + 8];
+		const void *src;
+
+		if (ai->ai_family == AF_INET)
+			src = &((const struct sockaddr_in *)ai->ai_addr)->sin_addr;
+		else if (ai->ai_family == AF_INET6)
+			src = &((const struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+		else
+			continue;
+
+		if (!inet_ntop(ai->ai_family, src, addr, sizeof(addr)))
+			continue;
+		snprintf(literal, sizeof(literal), ai->ai_family == AF_INET ? "[%s]" : "[ipv6:%s]", addr);
+
+		local = hash_lookup(local_names, literal) == LOCAL_NAME;
+	}
+
+	freeaddrinfo(res);
+
+	return local;
+}
+
+/** Whether a domain designates this host */
+static int local_domain(const char *domain)
+{
+	char *key;
+	void *value;
+	int local;
+
+	if (!local_names_ready)
+		local_names_init();
+
+	key = domain_key(domain);
+
+	if ((value = hash_lookup(local_names, key)))
+	{
+		free(key);
+		return value == LOCAL_NAME;
+	}
+
+	local = 0;
+	if (local_resolve && key[0] != '[')
+	{
+		local = local_domain_resolves(key);
+		hash_insert(local_names, key, local ? LOCAL_NAME : REMOTE_NAME);
+	}
+
+	free(key);
+
+	return local;
+}
+
+/*@}*/
+
+int local_address(const char *address)
+{
+	const char *at;
+
+	if (force_mda)
+		return 1;
+
+	if (!(at = strrchr(address, '@')))
+		return 1;
+
+	return local_domain(at + 1);
 }
 
 /** replace ' by _ */
@@ -49,6 +261,181 @@ static void sanitize(char *s)
 }
 
 
+/**
+ * \name Spooled local delivery
+ *
+ * With \c mda_workers set and a %T in the MDA command, or with \c lmtp set,
+ * the message is spooled to a temporary file instead of being piped to a
+ * single MDA, and delivered to each recipient once complete.
+ *
+ * The MDAs of the fan-out are run one per local recipient, at most
+ * \c mda_workers at a time, each reading the spooled message.
+ */
+/*@{*/
+
+int mda_workers = 0;
+
+static message_t *local_message = NULL;
+static char *local_from = NULL;
+static char *local_spool = NULL;
+
+/** A running MDA */
+typedef struct {
+	pid_t pid;
+	recipient_t *recipient;
+} mda_worker_t;
+
+static void local_spool_open(char *from)
+{
+	mda_fp = spool_open(&local_spool);
+
+	local_from = from;
+
+	if (verbose)
+		fprintf(stdout, "Spooling message for local delivery\n");
+}
+
+static void local_spool_close(void)
+{
+	if (mda_fp)
+	{
+		fclose(mda_fp);
+		mda_fp = NULL;
+	}
+
+	unlink(local_spool);
+	free(local_spool);
+	local_spool = NULL;
+
+	if (local_from)
+	{
+		free(local_from);
+		local_from = NULL;
+	}
+}
+
+/*@}*/
+
+
+/**
+ * Quote the local recipients for %T.
+ */
+/** Length of the user part of a local recipient, all the MDA is given */
+static int mda_user_length(const char *address)
+{
+	const char *at;
+
+	return (at = strrchr(address, '@')) ? at - address : (int)strlen(address);
+}
+
+static char *mda_names(message_t *message)
+{
+	struct list_head *ptr;
+	char *names, *p;
+	int nameslen;
+
+	/*
+	 * We go through this in order to be able to handle very
+	 * long lists of users and (re)implement %s.
+	 */
+	nameslen = 0;
+	list_for_each(ptr, &message->local_recipients)
+	{
+		recipient_t *recipient = list_entry(ptr, recipient_t, list);
+		
+		assert(recipient->address);
+		
+		nameslen += (strlen(recipient->address) + 3);	/* string + quotes + ' ' */
+	}
+
+	names = (char *)xmalloc(nameslen + 1);		/* account for '\0' */
+	p = names;
+	*p = '\0';
+	list_for_each(ptr, &message->local_recipients)
+	{
+		recipient_t *recipient = list_entry(ptr, recipient_t, list);
+		int written;
+		
+		sanitize(recipient->address);
+		written = sprintf(p, "'%.*s' ", mda_user_length(recipient->address), recipient->address);
+		if (written < 0)
+		{
+			perror(NULL);
+			exit(EX_OSERR);
+		}
+		p += written;
+	}
+	if (nameslen)
+		names[--nameslen] = '\0';		/* chop trailing space */
+
+	return names;
+}
+
+/**
+ * Expand %T and %F in the MDA command.
+ *
+ * \param names quoted recipients to insert for %T, or NULL.
+ * \param from sanitized reverse path to insert for %F, or NULL.
+ */
+static char *mda_expand(const char *names, const char *from)
+{
+	int		length, fromlen = 0, nameslen = 0;
+	char		*after, *sp, *dp;
+
+	length = strlen(mda);
+
+	/* do we have to build an mda string? */
+	if (!names && !from)
+		return xstrdup(mda);
+
+	if (names)
+		nameslen = strlen(names);
+	if (from)
+		fromlen = strlen(from);
+
+	/* find length of resulting mda string */
+	sp = mda;
+	while ((sp = strstr(sp, "%s"))) {
+		length += nameslen;		/* subtract %s and add '' */
+		sp += 2;
+	}
+	sp = mda;
+	while ((sp = strstr(sp, "%T"))) {
+		length += nameslen;		/* subtract %T and add '' */
+		sp += 2;
+	}
+	sp = mda;
+	while ((sp = strstr(sp, "%F"))) {
+		length += fromlen;		/* subtract %F and add '' */
+		sp += 2;
+	}
+
+	after = xmalloc(length + 1);
+
+	/* copy mda source string to after, while expanding %[sTF] */
+	for (dp = after, sp = mda; (*dp = *sp); dp++, sp++) {
+		if (sp[0] != '%')		continue;
+
+		/* need to expand? BTW, no here overflow, because in
+		** the worst case (end of string) sp[1] == '\0' */
+		if (sp[1] == 'T' && names) {
+			strcpy(dp, names);
+			dp += nameslen;
+			sp++;		/* position sp over [sT] */
+			dp--;		/* adjust dp */
+		} else if (sp[1] == 'F' && from) {
+			*dp++ = '\'';
+			strcpy(dp, from);
+			dp += fromlen;
+			*dp++ = '\'';
+			sp++;		/* position sp over F */
+			dp--;		/* adjust dp */
+		}
+	}
+
+	return after;
+}
+
 /**
  * Pipe the message to the MDA for local delivery.
  *
@@ -56,8 +443,15 @@ static void sanitize(char *s)
  */
 void local_init(message_t *message)
 {
-	int		length = 0, fromlen = 0, nameslen = 0;
-	char		*names = NULL, *before, *after, *from = NULL;
+	char		*names = NULL, *from = NULL, *command;
+
+	local_message = message;
+
+	if (lmtp)
+	{
+		local_spool_open(NULL);
+		return;
+	}
 
 	if (!mda)
 	{
@@ -65,49 +459,29 @@ void local_init(message_t *message)
 		exit(EX_OSFILE);
 	}
 
-	length = strlen(mda);
-	before = xstrdup(mda);
+	/* get From address for %F */
+	if (strstr(mda, "%F"))
+	{
+		from = xstrdup(message->reverse_path ? message->reverse_path : "");
+
+		sanitize(from);
+	}
 
 	/* get user addresses for %T */
-	if (strstr(before, "%T"))
+	if (strstr(mda, "%T"))
 	{
 		if (!force_mda)
 		{
-			struct list_head *ptr;
-			char *p;
-	
-			/*
-			 * We go through this in order to be able to handle very
-			 * long lists of users and (re)implement %s.
-			 */
-			nameslen = 0;
-			list_for_each(ptr, &message->local_recipients)
+			if (mda_workers > 0)
 			{
-				recipient_t *recipient = list_entry(ptr, recipient_t, list);
-				
-				assert(recipient->address);
-				
-				nameslen += (strlen(recipient->address) + 3);	/* string + quotes + ' ' */
+				local_spool_open(from);
+				return;
 			}
-	
-			names = (char *)xmalloc(nameslen + 1);		/* account for '\0' */
-			p = names;
-			list_for_each(ptr, &message->local_recipients)
-			{
-				recipient_t *recipient = list_entry(ptr, recipient_t, list);
-				int written;
-				
-				sanitize(recipient->address);
-				written = sprintf(p, "'%s' ", recipient->address);
-				if (written < 0)
-				{
-					perror(NULL);
-					exit(EX_OSERR);
-				}
-				p += written;
-			}
-			names[--nameslen] = '\0';		/* chop trailing space */
+
+			names = mda_names(message);
 		} else {
+			int nameslen;
+
 			nameslen = (strlen(force_mda) + 3);	// 'force_mda'
 			names = (char *)xmalloc(nameslen + 1);	// 'force_mda'\0
 
@@ -121,86 +495,23 @@ void local_init(message_t *message)
 		}
 	}
 
-	/* get From address for %F */
-	if (strstr(before, "%F"))
-	{
-		from = xstrdup(message->reverse_path ? message->reverse_path : "");
-
-		sanitize(from);
-
-		fromlen = strlen(from);
-	}
+	command = mda_expand(names, from);
 
-	/* do we have to build an mda string? */
-	if (names || from) 
-	{				
-		char		*sp, *dp;
-
-		/* find length of resulting mda string */
-		sp = before;
-		while ((sp = strstr(sp, "%s"))) {
-			length += nameslen;		/* subtract %s and add '' */
-			sp += 2;
-		}
-		sp = before;
-		while ((sp = strstr(sp, "%T"))) {
-			length += nameslen;		/* subtract %T and add '' */
-			sp += 2;
-		}
-		sp = before;
-		while ((sp = strstr(sp, "%F"))) {
-			length += fromlen;		/* subtract %F and add '' */
-			sp += 2;
-		}
+	if (names)
+		free(names);
+	if (from)
+		free(from);
 
-		after = xmalloc(length + 1);
-
-		/* copy mda source string to after, while expanding %[sTF] */
-		for (dp = after, sp = before; (*dp = *sp); dp++, sp++) {
-			if (sp[0] != '%')		continue;
-
-			/* need to expand? BTW, no here overflow, because in
-			** the worst case (end of string) sp[1] == '\0' */
-			if (sp[1] == 'T') {
-				strcpy(dp, names);
-				dp += nameslen;
-				sp++;		/* position sp over [sT] */
-				dp--;		/* adjust dp */
-			} else if (sp[1] == 'F') {
-				*dp++ = '\'';
-				strcpy(dp, from);
-				dp += fromlen;
-				*dp++ = '\'';
-				sp++;		/* position sp over F */
-				dp--;		/* adjust dp */
-			}
-		}
-
-		if (names) {
-			free(names);
-			names = NULL;
-		}
-		if (from) {
-			free(from);
-			from = NULL;
-		}
-
-		free(before);
-
-		before = after;
-	}
-
-
-	if(!(mda_fp = popen(before, "w")))
+	if(!(mda_fp = popen(command, "w")))
 	{
 		fprintf(stderr, "Failed to connect to MDA\n");
 		exit(EX_OSERR);
 	}
 		
 	if(verbose)
-		fprintf(stdout, "Connected to MDA: %s\n", before);
+		fprintf(stdout, "Connected to MDA: %s\n", command);
 
-	free(before);
+	free(command);
 }
 
 void local_flush(message_t *message)
@@ -218,22 +529,170 @@ void local_flush(message_t *message)
 	} while(n == BUFSIZ);
 }
 
-void local_cleanup(void)
+/**
+ * Report a MDA exit status.
+ *
+ * \return zero on success.
+ */
+static int mda_status(const char *recipient, int status)
 {
-	if(mda_fp)
+	const char *prefix = recipient ? recipient : "MDA";
+	const char *sep = recipient ? ": MDA" : "";
+
+	if (!status)
+		return 0;
+
+	if(WIFSIGNALED(status)) 
+		fprintf(stderr, "%s%s died of signal %d\n", prefix, sep, WTERMSIG(status));
+	else if(WIFEXITED(status))
+		fprintf(stderr, "%s%s returned nonzero status %d\n", prefix, sep, WEXITSTATUS(status));
+	else
+		fprintf(stderr, "%s%s failed\n", prefix, sep);
+
+	return 1;
+}
+
+/** Run a MDA command reading the spooled message */
+static pid_t fanout_spawn(const char *command)
+{
+	pid_t pid;
+	int fd;
+
+	if ((fd = open(local_spool, O_RDONLY)) < 0)
+		return -1;
+
+	if ((pid = fork()) == 0)
 	{
-		int status;
-		
-		if((status = pclose(mda_fp)))
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+
+	close(fd);
+
+	return pid;
+}
+
+/**
+ * Wait for one of the running MDAs, returning nonzero if it failed.
+ *
+ * Only the workers are waited for, as the caller may have other children,
+ * e.g., a LMTP server.
+ */
+static int fanout_wait(mda_worker_t *workers, int *nworkers)
+{
+	recipient_t *recipient;
+	pid_t pid = 0;
+	int status, i;
+
+	assert(*nworkers > 0);
+
+	/* one which is done already, or else the oldest */
+	for (i = 0; i < *nworkers; i++)
+		if ((pid = waitpid(workers[i].pid, &status, WNOHANG)) != 0)
+			break;
+	if (i == *nworkers)
+		while ((pid = waitpid(workers[i = 0].pid, &status, 0)) < 0 && errno == EINTR)
+			;
+
+	if (pid < 0)
+	{
+		perror("waitpid");
+		exit(EX_OSERR);
+	}
+
+	recipient = workers[i].recipient;
+	workers[i] = workers[--*nworkers];
+
+	if (verbose)
+		fprintf(stdout, "Disconnected to MDA for %s\n", recipient->address);
+
+	if (mda_status(recipient->address, status))
+		return 1;
+
+	recipient->delivered = 1;
+	return 0;
+}
+
+/**
+ * Deliver the spooled message to each local recipient.
+ *
+ * \return the number of failed deliveries.
+ */
+static int fanout_deliver(void)
+{
+	mda_worker_t *workers;
+	struct list_head *ptr;
+	int nworkers = 0, failures = 0;
+
+	workers = (mda_worker_t *)xmalloc(mda_workers * sizeof(mda_worker_t));
+
+	list_for_each(ptr, &local_message->local_recipients)
+	{
+		recipient_t *recipient = list_entry(ptr, recipient_t, list);
+		char *names, *command;
+
+		if (nworkers == mda_workers)
+			failures += fanout_wait(workers, &nworkers);
+
+		sanitize(recipient->address);
+		names = xmalloc(strlen(recipient->address) + 3);
+		sprintf(names, "'%.*s'", mda_user_length(recipient->address), recipient->address);
+		command = mda_expand(names, local_from);
+		free(names);
+
+		if ((workers[nworkers].pid = fanout_spawn(command)) < 0)
 		{
-			if(WIFSIGNALED(status)) 
-				fprintf(stderr, "MDA died of signal %d\n", WTERMSIG(status));
-			else if(WIFEXITED(status))
-				fprintf(stderr, "MDA returned nonzero status %d\n", WEXITSTATUS(status));
-			else
-				fprintf(stderr, "MDA failed\n");
-			exit(EX_OSERR);
+			fprintf(stderr, "%s: Failed to connect to MDA\n", recipient->address);
+			failures++;
+		}
+		else
+		{
+			if (verbose)
+				fprintf(stdout, "Connected to MDA: %s\n", command);
+
+			workers[nworkers++].recipient = recipient;
+		}
+
+		free(command);
+	}
+
+	while (nworkers)
+		failures += fanout_wait(workers, &nworkers);
+
+	free(workers);
+
+	return failures;
+}
+
+int local_cleanup(void)
+{
+	int failures = 0;
+
+	if(local_spool)
+	{
+		if(fflush(mda_fp))
+		{
+			perror(local_spool);
+			exit(EX_IOERR);
 		}
+
+		if(lmtp)
+			failures = lmtp_deliver(local_message, mda_fp);
+		else
+			failures = fanout_deliver();
+
+		local_spool_close();
+	}
+	else if(mda_fp)
+	{
+		struct list_head *ptr;
+
+		/* a single MDA for all of them */
+		if(!(failures = mda_status(NULL, pclose(mda_fp))))
+			list_for_each(ptr, &local_message->local_recipients)
+				list_entry(ptr, recipient_t, list)->delivered = 1;
 			
 		mda_fp = NULL;
 
@@ -241,9 +700,5 @@ void local_cleanup(void)
 			fprintf(stdout, "Disconnected to MDA\n");
 	}
 
-	if(mda)
-		free(mda);
-
-	if(force_mda)
-		free(force_mda);
+	return failures;
 }
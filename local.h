@@ -13,10 +13,22 @@
 
 extern char *mda;
 extern char *force_mda;
+extern int local_resolve;
+extern char **local_domains;	/**< NULL terminated, or NULL if none */
+extern int mda_workers;
 extern FILE *mda_fp;
 
 
-/** Check whether it's a local or a remote address */
+/** Add a domain to be treated as local */
+void local_domain_add(const char *domain);
+
+/**
+ * Check whether it's a local or a remote address.
+ *
+ * Addresses without a domain are local, as are those whose domain is this
+ * host's name, one of its address literals, a configured local domain or,
+ * with \c localresolve enabled, a name resolving to one of its addresses.
+ */
 int local_address(const char *address);
 
 /** Send a message locally (via a MDA) */
@@ -24,6 +36,11 @@ void local_init(message_t *msg);
 
 void local_flush(message_t *msg);
 
-void local_cleanup(void);
+/**
+ * Wait for the local delivery to finish.
+ *
+ * \return the number of failed local deliveries.
+ */
+int local_cleanup(void);
 
 #endif
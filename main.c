@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
@@ -21,7 +23,12 @@
 #include "message.h"
 #include "smtp.h"
 #include "local.h"
+#include "lmtp.h"
 #include "rcfile.h"
+#include "queue.h"
+#include "rate.h"
+#include "server.h"
+#include "xmalloc.h"
 
 
 static void drop_sgids( void )
@@ -44,22 +51,118 @@ typedef enum {
 	ENQUEUE,		/**< delivery mode */
 	NEWALIAS,		/**< initialize alias database */
 	MAILQ,			/**< list mail queue */
-	FLUSHQ			/**< flush the mail queue */
+	COUNTQ,			/**< print number of entries in the queue */
+	FLUSHQ,			/**< flush the mail queue */
+	SERVER			/**< speak SMTP on standard input and output */
 } opmode_t;
 
+/** Delivery modes. */
+typedef enum {
+	INTERACTIVE,		/**< deliver right away */
+	BACKGROUND,		/**< queue, and deliver in the background */
+	QUEUE			/**< just queue */
+} deliverymode_t;
+
 
 int verbose = 0;
 
 FILE *log_fp = NULL;
 
+/** Apply the policies needing the whole message, once spooled */
+static int message_check(message_t *message)
+{
+	/* Long lines can only be refused before anything is delivered */
+	if(long_lines == Long_lines_REJECT && message->longest_line > MAX_LINE_LENGTH)
+	{
+		fprintf(stderr, "Message has lines longer than %d characters\n", MAX_LINE_LENGTH);
+		return EX_DATAERR;
+	}
+
+	if(body_type_auto && message->body == E8bitmime_NOTSET)
+		message->body = message->eightbit ? E8bitmime_8BITMIME : E8bitmime_7BIT;
+
+	return EX_OK;
+}
+
+/**
+ * Queue a copy of a spooled message for the recipients it wasn't delivered
+ * to, once delivered to the others, so that retrying it doesn't deliver it to
+ * those twice.
+ *
+ * \return zero if there is no such copy to make, i.e., if it wasn't
+ * delivered to any recipient, or can't be read again.
+ */
+static int message_requeue_undelivered(message_t *message)
+{
+	message_t *copy;
+	struct list_head *ptr, *lists[2];
+	int delivered = 0, i;
+	char *id;
+
+	lists[0] = &message->remote_recipients;
+	lists[1] = &message->local_recipients;
+	for(i = 0; i < 2; i++)
+		list_for_each(ptr, lists[i])
+			delivered |= list_entry(ptr, recipient_t, list)->delivered;
+
+	if(!delivered || !message->spool_path)
+		return 0;
+
+	copy = message_new();
+	if(message->reverse_path)
+		message_set_reverse_path(copy, message->reverse_path);
+	if(message->envid)
+		message_set_envid(copy, message->envid);
+	copy->ret = message->ret;
+	copy->notify = message->notify;
+	copy->body = message->body;
+	copy->priority = message->priority;
+
+	for(i = 0; i < 2; i++)
+		list_for_each(ptr, lists[i])
+		{
+			recipient_t *recipient = list_entry(ptr, recipient_t, list);
+
+			if(!recipient->delivered)
+				message_add_recipient(copy, recipient->address);
+		}
+
+	if(!(copy->fp = fopen(message->spool_path, "r")))
+	{
+		perror(message->spool_path);
+		message_free(copy);
+		return 0;
+	}
+
+	queue_spool(copy);
+	id = queue_commit(copy);
+	fprintf(stderr, "Not delivered to all recipients, the others queued as %s\n", id);
+
+	free(id);
+	message_free(copy);
+
+	return 1;
+}
+
 static void message_send(message_t *message)
 {
-	int local, remote;
+	int local, remote, ret = EX_OK;
 	identity_t *identity;
 
 	/* Lookup the identity already here */
 	identity = identity_lookup(message->reverse_path); 
 	assert(identity);
+
+	/* Look at the whole message before delivering, if needed */
+	if(long_lines == Long_lines_REJECT || declare_size ||
+	   (body_type_auto && message->body == E8bitmime_NOTSET))
+		message_spool(message);
+
+	if((ret = message_check(message)) != EX_OK)
+	{
+		message_free(message);
+		exit(ret);
+	}
 	
 	if( identity->qualifydomain )
 	{
@@ -73,7 +176,7 @@ static void message_send(message_t *message)
 	}
 	
 	if(remote && !local)
-		smtp_send(message,identity);
+		ret = smtp_send_routed(message,identity);
 	else if(!remote && local)
 	{
 		local_init(message);
@@ -82,19 +185,443 @@ static void message_send(message_t *message)
 	else
 	{
 		local_init(message);
-		smtp_send(message,identity);
+		ret = smtp_send_routed(message,identity);
 		local_flush(message);
 	}
 	
-	local_cleanup();
+	if(local_cleanup() && ret == EX_OK)
+		ret = EX_OSERR;
+
+	/* Partly delivered, the rest is left to the queue */
+	if(ret != EX_OK && !message_requeue_undelivered(message))
+		exit(ret);
+}
+
+/**
+ * Queue a message instead of delivering it, unless message_check() refuses
+ * it.
+ *
+ * \param id set to the queue id, to be freed by the caller.
+ *
+ * \return a sysexits status.
+ */
+static int message_enqueue(message_t *message, char **id)
+{
+	int ret;
+
+	queue_spool(message);
+	if((ret = message_check(message)) != EX_OK)
+		return ret;
+
+	/* Unless given, from the headers or else the identity */
+	if(message->priority == Priority_NOTSET)
+		message->priority = message_header_priority(message);
+	if(message->priority == Priority_NOTSET)
+		message->priority = identity_lookup(message->reverse_path)->priority;
+
+	*id = queue_commit(message);
+
+	return EX_OK;
+}
+
+/**
+ * Queue a message instead of delivering it.
+ *
+ * \return the queue id, to be freed by the caller.
+ */
+static char *message_queue(message_t *message)
+{
+	char *id;
+	int ret;
+
+	if((ret = message_enqueue(message, &id)) != EX_OK)
+	{
+		message_free(message);
+		exit(ret);
+	}
+
+	return id;
+}
+
+/**
+ * Take a message from the rate limits of its identity, counting the
+ * recipients it relays to.
+ *
+ * \return zero if it's within them, or else the seconds until it is.
+ */
+static int message_rate_take(message_t *message, identity_t *identity)
+{
+	struct list_head *ptr;
+	int n = 0;
+
+	list_for_each(ptr, &message->remote_recipients)
+		n++;
+	if(identity->qualifydomain)
+		list_for_each(ptr, &message->local_recipients)
+			n++;
+
+	return n ? rate_take(identity, n) : 0;
+}
+
+/** Deliver a message in a child, as message_send() exits on failure */
+static int message_send_child(message_t *message)
+{
+	pid_t pid;
+	int status;
+
+	fflush(NULL);
+	if((pid = fork()) < 0)
+	{
+		perror("fork");
+		exit(EX_OSERR);
+	}
+
+	if(pid == 0)
+	{
+		message_send(message);
+		lmtp_close();
+		exit(EX_OK);
+	}
+
+	while(waitpid(pid, &status, 0) < 0)
+		if(errno != EINTR)
+		{
+			perror("waitpid");
+			exit(EX_OSERR);
+		}
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+}
+
+/** Whether a message only goes to the LMTP server */
+static int message_lmtp_only(message_t *message, identity_t *identity)
+{
+	return lmtp && list_empty(&message->remote_recipients) && !identity->qualifydomain;
+}
+
+/**
+ * Deliver a message with only local recipients over LMTP, in this process,
+ * so that the messages of a batch share the connection.
+ */
+static int message_send_lmtp(message_t *message)
+{
+	local_init(message);
+	local_flush(message);
+	if(!local_cleanup())
+		return EX_OK;
+
+	return message_requeue_undelivered(message) ? EX_OK : EX_OSERR;
+}
+
+/** Whether a message only goes to the relay of \p identity */
+static int message_batchable(message_t *message, identity_t *identity)
+{
+	struct list_head *ptr;
+
+	if(!list_empty(&message->local_recipients) && !identity->qualifydomain)
+		return 0;
+
+	list_for_each(ptr, &message->remote_recipients)
+		if(route_lookup(list_entry(ptr, recipient_t, list)->address))
+			return 0;
+
+	return 1;
+}
+
+#define SESSION_IDLE		30	/**< default time a session lingers idle, in seconds */
+#define SESSION_MESSAGES	100	/**< default messages sent before recycling a session */
+
+/** Session delivering the messages of a batch queued for an identity */
+typedef struct {
+	identity_t *identity;
+	const char *host;
+	message_t **messages;		/**< of the whole batch */
+	identity_t **identities;	/**< of those not reported yet */
+	queue_status_t *statuses;
+	int n;
+	int *batch_statuses;		/**< of those for the identity */
+	int sent;			/**< messages sent in the session so far */
+} message_session_t;
+
+/** Report the outcome of the messages of a session from the batch */
+static void message_session_report(message_session_t *session, int unreachable)
+{
+	int j, k;
+
+	for(j = 0, k = 0; j < session->n; j++)
+		if(session->identities[j] == session->identity)
+		{
+			session->statuses[j].status = session->batch_statuses[k++];
+			session->statuses[j].unreachable = unreachable;
+			strncpy(session->statuses[j].host, session->host, QUEUE_HOST_SIZE - 1);
+			session->identities[j] = NULL;
+		}
+}
+
+/** Whether a message just queued can follow in a lingering session */
+static int message_linger_accept(message_t *message, void *arg)
+{
+	identity_t *identity = (identity_t *)arg;
+
+	return identity_lookup(message->reverse_path) == identity &&
+		message_check(message) == EX_OK &&
+		message_batchable(message, identity) &&
+		!message_rate_take(message, identity);
+}
+
+/** Wait for a message to follow in a lingering session */
+static message_t *message_linger_next(void *arg)
+{
+	message_session_t *session = (message_session_t *)arg;
+	identity_t *identity = session->identity;
+	message_t *message;
+
+	/* The batch is done with by now */
+	message_session_report(session, 0);
+
+	if(session->sent >= (identity->session_messages ? identity->session_messages : SESSION_MESSAGES))
+		return NULL;
+
+	message = queue_linger(session->host, identity->sessions,
+	                       identity->session_idle ? identity->session_idle : SESSION_IDLE,
+	                       message_linger_accept, identity);
+	if(message)
+		session->sent++;
+
+	return message;
+}
+
+/** Account for a message sent by a lingering session */
+static void message_linger_done(message_t *message, int status, int tried, void *arg)
+{
+	message_session_t *session = (message_session_t *)arg;
+	queue_status_t result;
+
+	memset(&result, 0, sizeof(result));
+	result.status = status;
+	strncpy(result.host, session->host, QUEUE_HOST_SIZE - 1);
+
+	/* Not tried, as the session ended first */
+	if(!tried)
+		result.retry = time(NULL);
+
+	queue_linger_done(message, &result);
+}
+
+/**
+ * Deliver a batch of queued messages, in a child of the queue run.
+ *
+ * The messages only going to the relay of their identity share a session
+ * with the others for the same identity, unless that relay is deferred, and
+ * those only going to the LMTP server share a connection to it, while the
+ * rest are delivered on their own.  Those over the rate limits of
+ * their identity are held back.  The last session may linger for messages
+ * queued meanwhile, if the identity asks for it.
+ */
+static void message_send_queued(message_t **messages, int n, queue_status_t *statuses)
+{
+	identity_t **identities, *identity;
+	message_session_t session;
+	smtp_linger_t linger;
+	message_t **batch;
+	const char *host;
+	int *batch_statuses, *local;
+	int i, j, k, unreachable, wait;
+
+	identities = (identity_t **)xmalloc(n * sizeof(identity_t *));
+	local = (int *)xmalloc(n * sizeof(int));
+	batch = (message_t **)xmalloc(n * sizeof(message_t *));
+	batch_statuses = (int *)xmalloc(n * sizeof(int));
+
+	linger.next = message_linger_next;
+	linger.done = message_linger_done;
+	linger.arg = &session;
+
+	for(i = 0; i < n; i++)
+	{
+		identities[i] = identity_lookup(messages[i]->reverse_path);
+		assert(identities[i]);
+
+		host = identities[i]->host ? identities[i]->host : "localhost:25";
+		local[i] = 0;
+
+		if((statuses[i].status = message_check(messages[i])) != EX_OK)
+			identities[i] = NULL;
+		else if(!queue_host_deferred(host) &&
+		        (wait = message_rate_take(messages[i], identities[i])))
+		{
+			/* Over the rate limits, held back until within them */
+			statuses[i].status = EX_TEMPFAIL;
+			statuses[i].retry = time(NULL) + wait;
+			identities[i] = NULL;
+		}
+		else if(message_lmtp_only(messages[i], identities[i]))
+		{
+			local[i] = 1;
+			identities[i] = NULL;
+		}
+		else if(!message_batchable(messages[i], identities[i]))
+		{
+			statuses[i].status = message_send_child(messages[i]);
+			identities[i] = NULL;
+		}
+	}
+
+	/* Once the children above are done, not to share the connection */
+	for(i = 0; i < n; i++)
+		if(local[i])
+			statuses[i].status = message_send_lmtp(messages[i]);
+	lmtp_close();
+
+	for(i = 0; i < n; i++)
+	{
+		if(!(identity = identities[i]))
+			continue;
+
+		for(j = i, k = 0; j < n; j++)
+			if(identities[j] == identity)
+				batch[k++] = messages[j];
+
+		host = identity->host ? identity->host : "localhost:25";
+
+		session.identity = identity;
+		session.host = host;
+		session.messages = messages;
+		session.identities = identities;
+		session.statuses = statuses;
+		session.n = n;
+		session.batch_statuses = batch_statuses;
+		session.sent = k;
+
+		/* Only the last session lingers, as the batch waits for the others */
+		for(j = i + 1; j < n && (!identities[j] || identities[j] == identity); j++)
+			;
+
+		if(queue_host_deferred(host))
+		{
+			for(j = 0; j < k; j++)
+				batch_statuses[j] = EX_TEMPFAIL;
+			unreachable = 0;
+		}
+		else
+			unreachable = smtp_send_batch(batch, k, identity, batch_statuses,
+			                              j == n && identity->sessions ? &linger : NULL) < 0;
+
+		message_session_report(&session, unreachable);
+	}
+
+	free(batch_statuses);
+	free(batch);
+	free(local);
+	free(identities);
+}
+
+/**
+ * Deliver queued messages from a detached child, so that the caller doesn't
+ * wait for the relay.  Failures are left in the queue.
+ */
+static void message_deliver_background(char **ids, int n)
+{
+	pid_t pid;
+	int fd;
+
+	fflush(NULL);
+	if((pid = fork()) < 0)
+	{
+		/* they're queued anyway */
+		perror("fork");
+		return;
+	}
+
+	if(pid == 0)
+	{
+		/* Out of the caller's session, and off its pipes */
+		setsid();
+		if((fd = open("/dev/null", O_RDWR)) >= 0)
+		{
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			if(fd > STDERR_FILENO)
+				close(fd);
+		}
+		server_detach();
+
+		queue_deliver(ids, n, message_send_queued);
+		exit(EX_OK);
+	}
+}
+
+/** Queue a message and deliver it in the background */
+static void message_background(message_t *message)
+{
+	char *id;
+
+	id = message_queue(message);
+	message_deliver_background(&id, 1);
+	free(id);
+}
+
+/**
+ * \name SMTP submission
+ *
+ * The messages received with -bs are all queued, and then delivered in
+ * batches after the delivery mode, unless it's to just queue them.
+ */
+/*@{*/
+
+#define RECEIVED_BATCH	100	/**< messages received before delivering them */
+
+static deliverymode_t received_delivery;	/**< what to do with them */
+static char *received_ids[RECEIVED_BATCH];	/**< those yet to be delivered */
+static int nreceived = 0;
+
+/** Deliver the messages received so far */
+static void message_received_flush(void)
+{
+	int i;
+
+	if(!nreceived)
+		return;
+
+	if(received_delivery == BACKGROUND)
+		message_deliver_background(received_ids, nreceived);
+	else
+		queue_deliver(received_ids, nreceived, message_send_queued);
+
+	for(i = 0; i < nreceived; i++)
+		free(received_ids[i]);
+	nreceived = 0;
 }
 
+/** Take a message received over SMTP, as a server_accept_t */
+static int message_received(message_t *message, char **id)
+{
+	int ret;
+
+	if((ret = message_enqueue(message, id)) != EX_OK)
+		return ret;
+
+	if(received_delivery != QUEUE)
+	{
+		received_ids[nreceived++] = xstrdup(*id);
+		if(nreceived == RECEIVED_BATCH)
+			message_received_flush();
+	}
+
+	return EX_OK;
+}
+
+/*@}*/
+
 int main (int argc, char **argv)
 {
 	int c;
 	message_t *message;
 	int parse_headers = 0;
 	opmode_t mode;
+	deliverymode_t delivery = INTERACTIVE;
+	int negate, persistent = 0;
 	char *rcfile = NULL;
 	
 	message = message_new();
@@ -108,7 +635,7 @@ int main (int argc, char **argv)
 		mode = ENQUEUE;
 	}
 
-	while ((c = getopt (argc, argv, "A:B:b:C:cd:e:F:f:Gh:IiL:M:mN:nO:o:p:q:R:r:sTtV:vX:")) != EOF)
+	while ((c = getopt (argc, argv, "A:B:b:C:cd:e:F:f:Gh:IiL:M:mN:nO:o:p:q::R:r:sTtV:vX:")) != EOF)
 		switch (c)
 		{
 			case 'A':
@@ -212,6 +739,17 @@ int main (int argc, char **argv)
 						mode = MAILQ;
 						break;
 						
+					case 'P':
+						/* Print number of entries in the queue(s) */
+						mode = COUNTQ;
+						break;
+
+					case 's':
+						/* Use the SMTP protocol as described in RFC821
+						 * on standard input and output */
+						mode = SERVER;
+						break;
+
 					case 'a':
 						/* Go into ARPANET mode */
 					case 'd':
@@ -223,11 +761,6 @@ int main (int argc, char **argv)
 					case 'H':
 						/* Purge expired entries from the persistent host
 						 * status database */
-					case 'P':
-						/* Print number of entries in the queue(s) */
-					case 's':
-						/* Use the SMTP protocol as described in RFC821
-						 * on standard input and output */
 					case 't':
 						/* Run in address test mode */
 					case 'v':
@@ -280,6 +813,45 @@ int main (int argc, char **argv)
 
 			case 'o':
 				/* Set option */
+				if (optarg[0] == 'd')
+				{
+					/* Delivery mode */
+					if (optarg[1] == 'q')
+						delivery = QUEUE;
+					else if (optarg[1] == 'b')
+						delivery = BACKGROUND;
+					else if (optarg[1] == 'i')
+						delivery = INTERACTIVE;
+				}
+				break;
+
+			case 'O':
+				/* Set option, long form */
+				if (!strncmp (optarg, "DeliveryMode=", 13))
+				{
+					if (optarg[13] == 'q')
+						delivery = QUEUE;
+					else if (optarg[13] == 'b')
+						delivery = BACKGROUND;
+					else if (optarg[13] == 'i')
+						delivery = INTERACTIVE;
+				}
+				else if (!strncmp (optarg, "Priority=", 9))
+				{
+					if ((message->priority = priority_parse(optarg + 9)) == Priority_NOTSET)
+					{
+						fprintf (stderr, "Unsupported priority %s\n", optarg + 9);
+						exit (EX_USAGE);
+					}
+				}
+				else if (!strncmp (optarg, "Timeout.queuereturn=", 20))
+				{
+					if ((queue_lifetime = queue_parse_interval(optarg + 20)) <= 0)
+					{
+						fprintf (stderr, "Invalid queue lifetime %s\n", optarg + 20);
+						exit (EX_USAGE);
+					}
+				}
 				break;
 
 			case 'p':
@@ -288,10 +860,15 @@ int main (int argc, char **argv)
 
 			case 'q':
 				/* Run queue files at intervals */
-				mode = FLUSHQ;
+				if (mode != MAILQ && mode != COUNTQ)
+					mode = FLUSHQ;
+				if (optarg == NULL)
+					break;
+				negate = 0;
 				if (optarg[0] == '!')
 				{
 					/* Negate the meaning of pattern match */
+					negate = 1;
 					optarg++;
 				}
 
@@ -299,18 +876,18 @@ int main (int argc, char **argv)
 				{
 					case 'G':
 						/* Limit by queue group name */
-						break;
-
 					case 'I':
 						/* Limit by ID */
-						break;
-
 					case 'R':
 						/* Limit by recipient */
-						break;
-
 					case 'S':
 						/* Limit by sender */
+						if (optarg[1] == '\0')
+						{
+							fprintf (stderr, "Missing pattern for -q%c\n", optarg[0]);
+							exit (EX_USAGE);
+						}
+						queue_select(optarg[0], negate, optarg + 1);
 						break;
 
 					case 'f':
@@ -319,11 +896,19 @@ int main (int argc, char **argv)
 
 					case 'p':
 						/* Persistent queue */
+						persistent = 1;
 						if (optarg[1] == '\0')
 							break;
 						++optarg;
 
 					default:
+						/* Interval */
+						if ((queue_interval = queue_parse_interval(optarg)) < 0)
+						{
+							fprintf (stderr, "Invalid queue interval %s\n", optarg);
+							exit (EX_USAGE);
+						}
+						persistent = 1;
 						break;
 				}
 				break;
@@ -353,9 +938,35 @@ int main (int argc, char **argv)
 			break;
 		
 		case MAILQ:
-			printf ("Mail queue is empty\n");
-		case NEWALIAS:
+			rcfile_parse(rcfile);
+			queue_list();
+			goto cleanup;
+
+		case COUNTQ:
+			rcfile_parse(rcfile);
+			printf ("Total requests: %d\n", queue_count());
+			goto cleanup;
+
 		case FLUSHQ:
+			rcfile_parse(rcfile);
+			identities_init();
+			drop_sgids();
+			if (persistent)
+				queue_daemon(message_send_queued);
+			else
+				queue_run(message_send_queued);
+			goto cleanup;
+
+		case SERVER:
+			rcfile_parse(rcfile);
+			identities_init();
+			drop_sgids();
+			received_delivery = delivery;
+			server_run(message, message_received);
+			message_received_flush();
+			goto cleanup;
+
+		case NEWALIAS:
 			goto done;
 	}
 
@@ -390,9 +1001,28 @@ int main (int argc, char **argv)
 
 	drop_sgids();
 
-	message_send(message);
-	
+	if (delivery == QUEUE)
+		free(message_queue(message));
+	else if (delivery == BACKGROUND)
+		message_background(message);
+	else if (message_rate_take(message, identity_lookup(message->reverse_path)))
+	{
+		/* Over the rate limits, left for the queue runs to deliver in time */
+		char *id = message_queue(message);
+
+		if (verbose)
+			fprintf(stderr, "Rate limit reached, deferred as %s\n", id);
+		free(id);
+	}
+	else
+	{
+		message_send(message);
+		lmtp_close();
+	}
+
+cleanup:
 	identities_cleanup();
+	rcfile_cleanup();
 
 done:
 	if(log_fp)
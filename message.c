@@ -7,16 +7,33 @@
 
 
 #include <assert.h>
+#include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "message.h"
 #include "local.h"
+#include "lmtp.h"
 #include "rfc822.h"
 #include "xmalloc.h"
 
 
+/**
+ * Ceiling for the buffer holding the headers while they are parsed.  Beyond
+ * it, what was parsed already is spilled to a temporary file.
+ */
+#define MESSAGE_BUFFER_MAX	(1024 * 1024)
+
+enum long_lines long_lines = Long_lines_ALLOW;
+
+int body_type_auto = 0;
+
+int declare_size = 0;
+
+
 message_t *message_new(void)
 {
 	message_t *message;
@@ -25,6 +42,9 @@ message_t *message_new(void)
 
 	memset(message, 0, sizeof(message_t));
 
+	message->arena = arena_new();
+	message->recipients = hash_new_arena(message->arena);
+
 	INIT_LIST_HEAD(&message->remote_recipients);
 	INIT_LIST_HEAD(&message->local_recipients);
 	
@@ -37,74 +57,74 @@ message_t *message_new(void)
 
 void message_free(message_t *message)
 {
-	struct list_head *ptr, *tmp;
-	recipient_t *recipient;
-	
-	if(message->reverse_path)
-		free(message->reverse_path);
-
-	if(!list_empty(&message->remote_recipients))
-		list_for_each_safe(ptr, tmp, &message->remote_recipients)
-		{
-			recipient = list_entry(ptr, recipient_t, list);
-			list_del(ptr);
-			
-			assert(recipient->address);
-			
-			free(recipient->address);
-					
-			free(ptr);
-		}
-
-	if(!list_empty(&message->local_recipients))
-		list_for_each_safe(ptr, tmp, &message->local_recipients)
-		{
-			recipient = list_entry(ptr, recipient_t, list);
-			list_del(ptr);
-			
-			assert(recipient->address);
-			
-			free(recipient->address);
-					
-			free(ptr);
-		}
-
-	if(message->envid)
-		free(message->envid);
-
 	if(message->fp)
 		fclose(message->fp);
+
+	if(message->spill)
+		fclose(message->spill);
 	
+	if(message->spool_path)
+	{
+		if(!message->spool_keep)
+			unlink(message->spool_path);
+		free(message->spool_path);
+	}
+
+	/* The envelope goes all at once, the set of recipients with it */
+	arena_free(message->arena);
+
 	free(message);
 }
 	
 void message_set_reverse_path(message_t *message, const char *address)
 {
-	if(message->reverse_path)
-		free(message->reverse_path);
-
-	message->reverse_path = xstrdup(address);
+	message->reverse_path = arena_strdup(message->arena, address);
 }
 
 void message_set_envid(message_t *message, const char *address)
 {
-	if(message->envid)
-		free(message->envid);
-
-	message->envid = xstrdup(address);
+	message->envid = arena_strdup(message->arena, address);
 }
 
 void message_add_recipient(message_t *message, const char *address)
 {
 	recipient_t *recipient;
+	char *key, *p;
+	size_t len, klen;
+	int local;
 
 	if(address)
 	{
-		recipient = (recipient_t *)xmalloc(sizeof(recipient_t));
+		len = strlen(address);
+
+		/* Skip recipients already given, e.g. both in To: and Cc: or both
+		 * on the command line and in the headers, or the same user of
+		 * this host by several of its names for a MDA */
+		klen = len;
+		if((local = local_address(address)) && !force_mda && !lmtp)
+		{
+			char *at;
+
+			if((at = strrchr(address, '@')))
+				klen = at - address;
+		}
+
+		key = (char *)arena_alloc(message->arena, klen + 1);
+		for(p = key; p < key + klen; p++)
+			*p = tolower((unsigned char)address[p - key]);
+		*p = '\0';
 
-		recipient->address = xstrdup(address);
+		if(!hash_insert(message->recipients, key, NULL))
+			return;
 
-		if(local_address(address))
+		recipient = (recipient_t *)arena_alloc(message->arena, sizeof(recipient_t));
+
+		recipient->delivered = 0;
+		recipient->address = (char *)arena_alloc(message->arena, len + 1);
+		memcpy(recipient->address, address, len);
+		recipient->address[len] = '\0';
+
+		if(local)
 			list_add(&recipient->list, &message->local_recipients);
 		else
 			list_add(&recipient->list, &message->remote_recipients);
@@ -127,6 +147,12 @@ static void message_buffer_alloc(message_t *message)
 	message->buffer_size = buffer_size;
 }
 
+/**
+ * Read a line into the buffer.
+ *
+ * \return the start of the line or, if the buffer reached its ceiling first,
+ * of the part of it read so far, which won't end in a newline.
+ */
 static char *message_buffer_readline(message_t *message)
 {
 	FILE *fp = message->fp ? message->fp : stdin;
@@ -135,7 +161,12 @@ static char *message_buffer_readline(message_t *message)
 	while(1)
 	{
 		if(message->buffer_stop >= message->buffer_size - 1)
+		{
+			if(message->buffer_size >= MESSAGE_BUFFER_MAX)
+				return message->buffer + ret;
+
 			message_buffer_alloc(message);
+		}
 
 		if(!fgets(message->buffer + message->buffer_stop, message->buffer_size - message->buffer_stop, fp))
 			return NULL;
@@ -151,21 +182,84 @@ static char *message_buffer_readline(message_t *message)
 static void message_buffer_fill(message_t *message)
 {
 	FILE *fp = message->fp ? message->fp : stdin;
+	size_t n;
+
+	/* what overflowed the headers buffer comes first */
+	while(message->spill)
+	{
+		n = fread(message->buffer + message->buffer_stop, 1, message->buffer_size - message->buffer_stop, message->spill);
+		if(n)
+		{
+			message->buffer_stop += n;
+			return;
+		}
+
+		fclose(message->spill);
+		message->spill = NULL;
+	}
 
 	message->buffer_stop += fread(message->buffer + message->buffer_stop, 1, message->buffer_size - message->buffer_stop, fp);
 	
 }
 
+/**
+ * Hook for the MDA pipe, which wants the message with bare newlines, as
+ * given.  A spool has CRLF newlines, so the '\r's are dropped.
+ */
+static void message_hook(message_t *message, const char *p, size_t n)
+{
+	const char *end = p + n, *q;
+
+	if(!mda_fp || !n)
+		return;
+
+	if(!message->spool_crlf)
+	{
+		fwrite(p, 1, n, mda_fp);
+		return;
+	}
+
+	/* a '\r' ending the previous chunk */
+	if(message->hook_r && *p != '\n')
+		putc('\r', mda_fp);
+	message->hook_r = 0;
+
+	while((q = memchr(p, '\r', end - p)))
+	{
+		fwrite(p, 1, q - p, mda_fp);
+		if(q + 1 == end)
+			message->hook_r = 1;
+		else if(q[1] != '\n')
+			putc('\r', mda_fp);
+		p = q + 1;
+	}
+	fwrite(p, 1, end - p, mda_fp);
+}
+
 static size_t message_buffer_flush(message_t *message, char *ptr, size_t size)
 {
-	size_t count, n, s;
+	size_t count, n;
+	size_t s;
 	char *p, *q;
 	
 	s = message->buffer_start;
 	p = message->buffer + s;
 	count = 0;
-	while(count < size && message->buffer_start < message->buffer_stop)
+	while(count < size && (message->fold || message->buffer_start < message->buffer_stop))
 	{
+		/* finish a line fold */
+		if(message->fold)
+		{
+			*ptr++ = "\r\n "[3 - message->fold--];
+			count++;
+			if(!message->fold)
+			{
+				message->line_length = 1;
+				message->buffer_r = 0;
+			}
+			continue;
+		}
+
 		q = memchr(p, '\n', message->buffer_stop - message->buffer_start);
 		
 		if(q)
@@ -175,10 +269,27 @@ static size_t message_buffer_flush(message_t *message, char *ptr, size_t size)
 			/* read up to the end of the buffer */
 			n = message->buffer_stop - message->buffer_start;
 
+		if(long_lines == Long_lines_FOLD)
+		{
+			/* a '\r' just before the newline doesn't count */
+			size_t len = q && n && p[n - 1] == '\r' ? n - 1 : n;
+
+			if(message->line_length + len > MAX_LINE_LENGTH)
+			{
+				n = MAX_LINE_LENGTH - message->line_length;
+				q = NULL;
+				if(n <= size - count)
+					message->fold = 3;
+			}
+		}
+
 		if(n)
 		{
 			if(n > (size - count))
+			{
 				n = size - count;
+				q = NULL;
+			}
 			
 			memcpy(ptr, p, n);
 
@@ -186,6 +297,7 @@ static size_t message_buffer_flush(message_t *message, char *ptr, size_t size)
 			message->buffer_start += n;
 			ptr += n;
 			count += n;
+			message->line_length += n;
 
 			message->buffer_r = *(p - 1) == '\r';
 		}
@@ -212,12 +324,12 @@ static size_t message_buffer_flush(message_t *message, char *ptr, size_t size)
 			*ptr++ = *p++;	/* '\n' */
 			message->buffer_start++;
 			count++;
+			message->line_length = 0;
 		}
 	}
 
 	/* hook for the MDA pipe */
-	if(mda_fp && message->buffer_start != s)
-		fwrite(message->buffer +s, 1, message->buffer_start - s, mda_fp);
+	message_hook(message, message->buffer + s, message->buffer_start - s);
 
 	if(message->buffer_start == message->buffer_stop)
 		message->buffer_start = message->buffer_stop = 0;
@@ -233,19 +345,37 @@ size_t message_read(message_t *message, char *ptr, size_t size)
 	if(!message->buffer)
 		message_buffer_alloc(message);
 
-	n = message_buffer_flush(message, p, size);
-	count += n;
-	p += n;
-	
-	while(count != size)
+	if(message->spool_crlf && message->buffer_start == message->buffer_stop &&
+	   !(long_lines == Long_lines_FOLD && message->longest_line > MAX_LINE_LENGTH))
 	{
-		message_buffer_fill(message);
-		
-		if(!(n = message_buffer_flush(message, p, size - count)))
-			break;
+		/* A spool is already in wire format, short of folding long
+		 * lines, so it can be handed over as it is */
+		count = fread(ptr, 1, size, message->fp);
+		message_hook(message, ptr, count);
+	}
+	else
+	{
+		n = message_buffer_flush(message, p, size);
 		count += n;
 		p += n;
-	};
+	
+		while(count != size)
+		{
+			message_buffer_fill(message);
+		
+			if(!(n = message_buffer_flush(message, p, size - count)))
+				break;
+			count += n;
+			p += n;
+		};
+	}
+
+	/* the message ends with a lone '\r' */
+	if(count != size && message->hook_r)
+	{
+		putc('\r', mda_fp);
+		message->hook_r = 0;
+	}
 		
 	return count;
 }
@@ -254,12 +384,203 @@ int message_eof(message_t *message)
 {
 	FILE *fp = message->fp ? message->fp : stdin;
 	
-	if(message->buffer_start != message->buffer_stop)
+	if(message->buffer_start != message->buffer_stop || message->fold || message->spill)
 		return 0;
 
 	return feof(fp);
 }
 
+FILE *spool_create(const char *dir, const char *name, char **path)
+{
+	FILE *fp;
+	int fd;
+
+	*path = xmalloc(strlen(dir) + strlen(name) + 2);
+	strcpy(*path, dir);
+	strcat(*path, "/");
+	strcat(*path, name);
+
+	if ((fd = mkstemp(*path)) < 0 || !(fp = fdopen(fd, "w+")))
+	{
+		perror(*path);
+		exit(EX_CANTCREAT);
+	}
+
+	return fp;
+}
+
+FILE *spool_open(char **path)
+{
+	const char *tmpdir;
+
+	if (!(tmpdir = getenv("TMPDIR")))
+		tmpdir = "/tmp";
+
+	return spool_create(tmpdir, "esmtp.XXXXXX", path);
+}
+
+/** Whether a chunk has octets above 127, looking at several words at a time */
+static int message_scan_8bit(const char *p, size_t n)
+{
+	const unsigned long mask = (unsigned long)-1 / 0xff * 0x80;
+	const char *end = p + n;
+	unsigned long w[4];
+
+	for(; end - p >= (ptrdiff_t)sizeof(w); p += sizeof(w))
+	{
+		/* copied rather than cast, as the chunk may be unaligned */
+		memcpy(w, p, sizeof(w));
+		if((w[0] | w[1] | w[2] | w[3]) & mask)
+			return 1;
+	}
+
+	for(; p < end; p++)
+		if(*p & 0x80)
+			return 1;
+
+	return 0;
+}
+
+/** Account for a line of \p len octets, not counting its newline */
+static void message_scan_line(message_t *message, size_t len)
+{
+	if(len > message->longest_line)
+		message->longest_line = len;
+
+	/* see message_buffer_flush() */
+	if(long_lines == Long_lines_FOLD && len > MAX_LINE_LENGTH)
+		message->size += 3 * ((len - MAX_LINE_LENGTH + (MAX_LINE_LENGTH - 2)) / (MAX_LINE_LENGTH - 1));
+}
+
+/** Gather the properties of a chunk of the message */
+static void message_scan(message_t *message, const char *p, size_t n)
+{
+	const char *end = p + n, *q;
+
+	if(!message->eightbit)
+		message->eightbit = message_scan_8bit(p, n);
+
+	message->size += n;
+
+	while((q = memchr(p, '\n', end - p)))
+	{
+		size_t len = message->scan_line + (q - p);
+		int cr = q > p ? q[-1] == '\r' : message->scan_r;
+
+		/* don't count the '\r' of a CRLF, and count the one which will be
+		 * added to a bare newline */
+		if(cr)
+			len--;
+		else
+			message->size++;
+
+		message_scan_line(message, len);
+
+		message->scan_line = 0;
+		message->scan_r = 0;
+		p = q + 1;
+	}
+
+	if(p != end)
+	{
+		message->scan_line += end - p;
+		message->scan_r = end[-1] == '\r';
+	}
+}
+
+void message_spool_in(message_t *message, const char *dir, const char *name)
+{
+	FILE *in = message->fp ? message->fp : stdin;
+	FILE *fp;
+	int cr = 0;
+
+	if(message->spool_path)
+		return;
+
+	if(dir)
+		fp = spool_create(dir, name, &message->spool_path);
+	else
+		fp = spool_open(&message->spool_path);
+
+	/* what was already buffered, e.g., the headers, and the rest */
+	if(!message->buffer)
+		message_buffer_alloc(message);
+
+	do {
+		const char *p = message->buffer + message->buffer_start;
+		const char *end = message->buffer + message->buffer_stop, *q;
+
+		message_scan(message, p, end - p);
+
+		/* with CRLF newlines */
+		while((q = memchr(p, '\n', end - p)))
+		{
+			if(q > p ? q[-1] != '\r' : !cr)
+			{
+				fwrite(p, 1, q - p, fp);
+				fputs("\r\n", fp);
+			}
+			else
+				fwrite(p, 1, q + 1 - p, fp);
+			cr = 0;
+			p = q + 1;
+		}
+		if(p != end)
+		{
+			fwrite(p, 1, end - p, fp);
+			cr = end[-1] == '\r';
+		}
+
+		message->buffer_start = message->buffer_stop = 0;
+		message_buffer_fill(message);
+	} while(message->buffer_stop);
+
+	/* the last line, which the transfer will terminate with a CRLF */
+	if(message->scan_line)
+	{
+		message_scan_line(message, message->scan_line);
+		message->size += 2;
+	}
+
+	if(ferror(in) || fflush(fp) || ferror(fp))
+	{
+		perror(message->spool_path);
+		exit(EX_IOERR);
+	}
+
+	rewind(fp);
+
+	if(message->fp)
+		fclose(message->fp);
+	message->fp = fp;
+	message->spool_crlf = 1;
+}
+
+void message_spool(message_t *message)
+{
+	message_spool_in(message, NULL, NULL);
+}
+
+void message_reopen(message_t *message)
+{
+	assert(message->spool_path);
+
+	if(message->fp)
+		fclose(message->fp);
+
+	if(!(message->fp = fopen(message->spool_path, "r")))
+	{
+		perror(message->spool_path);
+		exit(EX_IOERR);
+	}
+
+	message->buffer_start = message->buffer_stop = 0;
+	message->buffer_r = 0;
+	message->line_length = 0;
+	message->fold = 0;
+	message->hook_r = 0;
+}
+
 static unsigned message_parse_header(message_t *message, size_t start, size_t stop)
 {
 	unsigned count = 0;
@@ -300,7 +621,7 @@ static unsigned message_parse_header(message_t *message, size_t start, size_t st
 	{
 		size_t n = message->buffer_stop - stop;
 
-		memcpy(header, next, n);
+		memmove(header, next, n);
 
 		message->buffer_stop = start + n;
 	}
@@ -308,11 +629,38 @@ static unsigned message_parse_header(message_t *message, size_t start, size_t st
 	return count;
 }
 
+/**
+ * Move the first \p n bytes of the buffer to the spill file, to make room
+ * in the buffer.
+ */
+static void message_spill(message_t *message, size_t n)
+{
+	if(!message->spill)
+	{
+		char *path;
+
+		message->spill = spool_open(&path);
+		unlink(path);
+		free(path);
+	}
+
+	if(fwrite(message->buffer, 1, n, message->spill) != n)
+	{
+		perror("spill");
+		exit(EX_IOERR);
+	}
+
+	memmove(message->buffer, message->buffer + n, message->buffer_stop - n);
+	message->buffer_stop -= n;
+}
+
 unsigned message_parse_headers(message_t *message)
 {
 	char *line;
 	size_t start, stop;
 	unsigned count = 0;
+	int bol = 1;		/* whether the line read starts a line */
+	int skip = 0;		/* whether the header is too long to be parsed */
 
 	assert(!message->buffer);
 
@@ -321,23 +669,164 @@ unsigned message_parse_headers(message_t *message)
 	start = 0;
 	while((line = message_buffer_readline(message)))
 	{
-		if(line[0] == ' ' || line[0] == '\t')
+		int partial = message->buffer[message->buffer_stop - 1] != '\n';
+
+		if(!bol || line[0] == ' ' || line[0] == '\t')
 		{
 			/* append line */
 		}
 		else
 		{
 			stop = line - message->buffer;
-			if(stop)
+			if(stop && !skip)
+			{
+				size_t before = message->buffer_stop;
+
 				count += message_parse_header(message, start, stop);
 
+				/* a Bcc: header was removed */
+				stop -= before - message->buffer_stop;
+			}
+
 			start = stop;
+			skip = 0;
+
+			if(message->buffer[start] == '\n' || message->buffer[start] == '\r')
+			{
+				/* the body will be read after the spilled headers */
+				if(message->spill)
+				{
+					message_spill(message, message->buffer_stop);
+					if(fflush(message->spill) || fseek(message->spill, 0L, SEEK_SET))
+					{
+						perror("spill");
+						exit(EX_IOERR);
+					}
+				}
 
-			if(line[0] == '\n' || line[0] == '\r')
 				return count;
+			}
+		}
+
+		bol = !partial;
+
+		if(partial)
+		{
+			/* The buffer reached its ceiling.  Make room by spilling the
+			 * headers parsed so far, or, if the current header fills it
+			 * alone, by giving up on parsing it. */
+			if(!start && !skip)
+			{
+				if(!strncasecmp("To:", message->buffer, 3) ||
+				   !strncasecmp("Cc:", message->buffer, 3) ||
+				   !strncasecmp("Bcc:", message->buffer, 4))
+				{
+					fprintf(stderr, "Recipient header too long\n");
+					exit(EX_DATAERR);
+				}
+
+				skip = 1;
+			}
+
+			message_spill(message, skip ? message->buffer_stop : start);
+			start = 0;
 		}
 	}
 	
 	fprintf(stderr, "Failed to parse headers\n");
 	exit(EX_DATAERR);
 }
+
+enum priority priority_parse(const char *name)
+{
+	if(!strcasecmp(name, "urgent"))
+		return Priority_URGENT;
+	else if(!strcasecmp(name, "normal"))
+		return Priority_NORMAL;
+	else if(!strcasecmp(name, "bulk"))
+		return Priority_BULK;
+	else
+		return Priority_NOTSET;
+}
+
+/** Whether \p value, past its blanks, starts with \p word */
+static int message_header_is(const char *value, const char *word)
+{
+	size_t len = strlen(word);
+
+	while(*value == ' ' || *value == '\t')
+		value++;
+
+	return !strncasecmp(value, word, len) && !isalnum((unsigned char)value[len]) &&
+		value[len] != '-';
+}
+
+enum priority message_header_priority(message_t *message)
+{
+	enum priority priority = Priority_NOTSET;
+	char line[256];
+	int bol = 1;
+	FILE *fp;
+
+	assert(message->spool_path);
+	if(!(fp = fopen(message->spool_path, "r")))
+		return Priority_NOTSET;
+
+	while(priority == Priority_NOTSET && fgets(line, sizeof(line), fp))
+	{
+		const char *value;
+		int start = bol;
+
+		bol = strchr(line, '\n') != NULL;
+		if(!start)
+			continue;
+
+		/* end of the headers */
+		if(line[0] == '\r' || line[0] == '\n')
+			break;
+
+		if(!strncasecmp("Precedence:", line, 11))
+		{
+			value = line + 11;
+			if(message_header_is(value, "bulk") || message_header_is(value, "list") ||
+			   message_header_is(value, "junk"))
+				priority = Priority_BULK;
+		}
+		else if(!strncasecmp("Priority:", line, 9))
+		{
+			value = line + 9;
+			if(message_header_is(value, "urgent"))
+				priority = Priority_URGENT;
+			else if(message_header_is(value, "normal"))
+				priority = Priority_NORMAL;
+			else if(message_header_is(value, "non-urgent"))
+				priority = Priority_BULK;
+		}
+		else if(!strncasecmp("X-Priority:", line, 11))
+		{
+			value = line + 11;
+			while(*value == ' ' || *value == '\t')
+				value++;
+			if(*value == '1' || *value == '2')
+				priority = Priority_URGENT;
+			else if(*value == '3')
+				priority = Priority_NORMAL;
+			else if(*value == '4' || *value == '5')
+				priority = Priority_BULK;
+		}
+		else if(!strncasecmp("Importance:", line, 11))
+		{
+			value = line + 11;
+			if(message_header_is(value, "high"))
+				priority = Priority_URGENT;
+			else if(message_header_is(value, "normal"))
+				priority = Priority_NORMAL;
+			else if(message_header_is(value, "low"))
+				priority = Priority_BULK;
+		}
+	}
+
+	fclose(fp);
+
+	return priority;
+}
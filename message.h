@@ -11,17 +11,55 @@
 
 #include <libesmtp.h>
 
+#include "arena.h"
+#include "hash.h"
 #include "list.h"
 
 
 /**
  * Item of the recipient list.
+ *
+ * Recipients are allocated from the message arena and live as long as the
+ * message.
  */
 typedef struct {
 	struct list_head list;
 	char *address;
+	int delivered;		/**< whether it got the message, even if others didn't */
 } recipient_t;
 
+/**
+ * Maximum line length allowed by RFC 5322, not counting the CRLF.
+ */
+#define MAX_LINE_LENGTH	998
+
+/**
+ * How to handle lines longer than #MAX_LINE_LENGTH.
+ */
+enum long_lines {
+	Long_lines_ALLOW,	/**< send them as they are */
+	Long_lines_FOLD,	/**< break them with a CRLF and a space */
+	Long_lines_REJECT,	/**< refuse the message */
+};
+
+extern enum long_lines long_lines;
+
+/**
+ * Delivery priority, which picks the lane a queued message waits in.
+ */
+enum priority {
+	Priority_NOTSET,
+	Priority_URGENT,	/**< interactive mail, such as password resets */
+	Priority_NORMAL,
+	Priority_BULK,		/**< newsletters and mailing lists */
+};
+
+/** Whether to choose the body type from the content, absent \c -B */
+extern int body_type_auto;
+
+/** Whether to declare the size of messages before sending them */
+extern int declare_size;
+
 /**
  * A message.
  */
@@ -39,6 +77,9 @@ typedef struct {
     
 	/** 8bit-MIME transport */
 	enum e8bitmime_body body;
+
+	/** Delivery priority, from the command line */
+	enum priority priority;
    
 	/** \name buffering */
 	/*@{*/
@@ -46,9 +87,28 @@ typedef struct {
 	size_t buffer_size;
 	size_t buffer_start, buffer_stop;
 	int buffer_r;		/**< whether the last character was a '\r' */
+	size_t line_length;	/**< octets sent so far on the current line */
+	int fold;		/**< octets of a line fold still to be sent */
 	/*@}*/
 	
 	FILE *fp;		/**< message file pointer */
+	FILE *spill;		/**< overflow of the header buffer, read before fp */
+	char *spool_path;	/**< temporary copy of the message, if spooled */
+	int spool_crlf;		/**< whether fp is the spool, with CRLF newlines */
+	int spool_keep;		/**< whether the spool outlives the message */
+	int hook_r;		/**< whether a '\r' is held back from the MDA */
+
+	/** \name Properties gathered while spooling */
+	/*@{*/
+	size_t scan_line;	/**< length of the current line */
+	int scan_r;		/**< whether the last character was a '\r' */
+	size_t longest_line;	/**< length of the longest line, without newline */
+	int eightbit;		/**< whether there are octets above 127 */
+	unsigned long size;	/**< size once converted to CRLF newlines */
+	/*@}*/
+
+	arena_t *arena;		/**< envelope storage, freed with the message */
+	hash_t *recipients;	/**< set of the recipients, case folded */
 } message_t;
 
 /** Create a new message. */
@@ -59,12 +119,63 @@ void message_free(message_t *m);
 
 void message_set_reverse_path(message_t *message, const char *address);
 
+/**
+ * Add a recipient, unless it was already added.  Addresses are compared
+ * case-insensitively, after local ones are reduced to the user name.
+ */
 void message_add_recipient(message_t *message, const char *address);
 
 void message_set_envid(message_t *message, const char *address);
 
 unsigned message_parse_headers(message_t *message);
 
+/**
+ * Parse a priority name, i.e., "urgent", "normal" or "bulk".
+ *
+ * \return Priority_NOTSET if it's unknown.
+ */
+enum priority priority_parse(const char *name);
+
+/**
+ * Priority asked for by the headers of a spooled message, through
+ * Precedence:, Priority:, X-Priority: or Importance:.
+ *
+ * \return Priority_NOTSET if there is none.
+ */
+enum priority message_header_priority(message_t *message);
+
+/**
+ * Create a temporary file in $TMPDIR (or /tmp).
+ *
+ * \param path set to the file's name, to be freed by the caller.
+ */
+FILE *spool_open(char **path);
+
+/**
+ * Create a temporary file in \p dir.
+ *
+ * \param name a template for mkstemp(), i.e., ending in "XXXXXX".
+ */
+FILE *spool_create(const char *dir, const char *name, char **path);
+
+/**
+ * Copy the rest of the message to a temporary file and read it from there
+ * from now on, so that it can be read by several processes.
+ *
+ * The copy has CRLF newlines, so that reading it back for the transfer is
+ * mostly a matter of copying it in bulk.
+ *
+ * The properties of the message, such as its longest line, are gathered
+ * along the way.
+ */
+void message_spool(message_t *message);
+
+/** Spool a message into a file created as by spool_create() */
+void message_spool_in(message_t *message, const char *dir, const char *name);
+
+/** Read a spooled message from its beginning through a new file description */
+void message_reopen(message_t *message);
+
 size_t message_read(message_t *message, char *ptr, size_t size);
 
 int message_eof(message_t *message);
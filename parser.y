@@ -25,6 +25,10 @@
 #include "main.h"
 #include "smtp.h"
 #include "local.h"
+#include "lmtp.h"
+#include "message.h"
+#include "queue.h"
+#include "rcfile.h"
 #include "xmalloc.h"
 
 extern int yylex (void);
@@ -37,6 +41,8 @@ int yydebug;			/**< in case we didn't generate with -- debug */
 
 static identity_t *identity = NULL;
 
+arena_t *config_arena = NULL;
+
 /**
  * Utility macro to set the default identity, if one isn't set yet. 
  * 
@@ -46,7 +52,7 @@ static identity_t *identity = NULL;
  */
 #define SET_DEFAULT_IDENTITY						\
 do {									\
-	if(!default_identity)						\
+	if(!default_identity && !identity->route)			\
 		default_identity = identity;				\
 } while(0)
 
@@ -64,11 +70,11 @@ void yyerror (const char *s);
     char *sval;
 }
 
-%token IDENTITY DEFAULT HOSTNAME USERNAME PASSWORD STARTTLS CERTIFICATE_PASSPHRASE PRECONNECT POSTCONNECT MDA QUALIFYDOMAIN HELO FORCE SENDER MSGID REVERSE_PATH FORCE_MDA
+%token IDENTITY DEFAULT HOSTNAME USERNAME PASSWORD STARTTLS CERTIFICATE_PASSPHRASE PRECONNECT POSTCONNECT MDA QUALIFYDOMAIN HELO FORCE SENDER MSGID REVERSE_PATH FORCE_MDA LOCALDOMAIN LOCALRESOLVE MDA_WORKERS LMTP CONFIG_CACHE ROUTE LONG_LINES BODY_TYPE MSGSIZE CHUNKSIZE QUEUEDIR PRIORITY MESSAGES_PER_MINUTE RECIPIENTS_PER_HOUR SESSIONS SESSION_IDLE SESSION_MESSAGES
 
 %token MAP
 
-%token DISABLED ENABLED REQUIRED
+%token DISABLED ENABLED REQUIRED FOLD REJECT AUTO
 %token <sval>  STRING
 %token <number> NUMBER
 
@@ -94,7 +100,12 @@ identity	: IDENTITY map STRING
 			{
 				identity = identity_new();
 				identity_add(identity);
-				identity->address = xstrdup($3);
+				identity->address = $3;
+			}
+		| ROUTE map STRING
+			{
+				identity = identity_new();
+				route_add(identity, $3);
 			}
 		;
 
@@ -103,24 +114,86 @@ statement_list	: statement
 		;
 
 /* future global options should also have the form SET <name> optmap <value> */
-statement	: HOSTNAME map STRING	{ identity->host = xstrdup($3); SET_DEFAULT_IDENTITY; }
-		| USERNAME map STRING	{ identity->user = xstrdup($3); SET_DEFAULT_IDENTITY; }
-		| PASSWORD map STRING	{ identity->pass = xstrdup($3); SET_DEFAULT_IDENTITY; }
+statement	: HOSTNAME map STRING	{ identity->host = $3; SET_DEFAULT_IDENTITY; }
+		| USERNAME map STRING	{ identity->user = $3; SET_DEFAULT_IDENTITY; }
+		| PASSWORD map STRING	{ identity->pass = $3; SET_DEFAULT_IDENTITY; }
 		| STARTTLS map DISABLED	{ identity->starttls = Starttls_DISABLED; SET_DEFAULT_IDENTITY; }
 		| STARTTLS map ENABLED	{ identity->starttls = Starttls_ENABLED; SET_DEFAULT_IDENTITY; }
 		| STARTTLS map REQUIRED	{ identity->starttls = Starttls_REQUIRED; SET_DEFAULT_IDENTITY; }
-		| CERTIFICATE_PASSPHRASE map STRING { identity->certificate_passphrase = xstrdup($3); SET_DEFAULT_IDENTITY; }
-		| PRECONNECT map STRING	{ identity->preconnect = xstrdup($3); SET_DEFAULT_IDENTITY; }
-		| POSTCONNECT map STRING { identity->postconnect = xstrdup($3); SET_DEFAULT_IDENTITY; }
-		| QUALIFYDOMAIN map STRING	{ identity->qualifydomain = xstrdup($3); SET_DEFAULT_IDENTITY; }
-		| HELO map STRING	{ identity->helo = xstrdup($3); SET_DEFAULT_IDENTITY; }
-		| FORCE REVERSE_PATH map STRING	{ identity->force_reverse_path = xstrdup($4); SET_DEFAULT_IDENTITY; }
-		| FORCE SENDER map STRING	{ identity->force_sender = xstrdup($4); SET_DEFAULT_IDENTITY; }
+		| CERTIFICATE_PASSPHRASE map STRING { identity->certificate_passphrase = $3; SET_DEFAULT_IDENTITY; }
+		| PRECONNECT map STRING	{ identity->preconnect = $3; SET_DEFAULT_IDENTITY; }
+		| POSTCONNECT map STRING { identity->postconnect = $3; SET_DEFAULT_IDENTITY; }
+		| QUALIFYDOMAIN map STRING	{ identity->qualifydomain = $3; SET_DEFAULT_IDENTITY; }
+		| HELO map STRING	{ identity->helo = $3; SET_DEFAULT_IDENTITY; }
+		| FORCE REVERSE_PATH map STRING	{ identity->force_reverse_path = $4; SET_DEFAULT_IDENTITY; }
+		| FORCE SENDER map STRING	{ identity->force_sender = $4; SET_DEFAULT_IDENTITY; }
 		| MSGID map DISABLED	{ identity->prohibit_msgid = 1; SET_DEFAULT_IDENTITY; }
 		| MSGID map ENABLED	{ identity->prohibit_msgid = 0; SET_DEFAULT_IDENTITY; }
-		| MDA map STRING	{ mda = xstrdup($3); }
-		| FORCE_MDA map STRING	{ force_mda = xstrdup($3); }
-		| DEFAULT		{ default_identity = identity; }
+		| PRIORITY map STRING
+			{
+				if ((identity->priority = priority_parse($3)) == Priority_NOTSET)
+					yyerror("priority must be urgent, normal or bulk");
+				SET_DEFAULT_IDENTITY;
+			}
+		| MESSAGES_PER_MINUTE map NUMBER
+			{
+				if ($3 < 0)
+					yyerror("messages_per_minute can't be negative");
+				identity->messages_per_minute = $3;
+				SET_DEFAULT_IDENTITY;
+			}
+		| RECIPIENTS_PER_HOUR map NUMBER
+			{
+				if ($3 < 0)
+					yyerror("recipients_per_hour can't be negative");
+				identity->recipients_per_hour = $3;
+				SET_DEFAULT_IDENTITY;
+			}
+		| SESSIONS map NUMBER
+			{
+				if ($3 < 0)
+					yyerror("sessions can't be negative");
+				identity->sessions = $3;
+				SET_DEFAULT_IDENTITY;
+			}
+		| SESSION_IDLE map NUMBER
+			{
+				if ($3 <= 0)
+					yyerror("session_idle must be positive");
+				identity->session_idle = $3;
+				SET_DEFAULT_IDENTITY;
+			}
+		| SESSION_MESSAGES map NUMBER
+			{
+				if ($3 <= 0)
+					yyerror("session_messages must be positive");
+				identity->session_messages = $3;
+				SET_DEFAULT_IDENTITY;
+			}
+		| MDA map STRING	{ mda = $3; }
+		| FORCE_MDA map STRING	{ force_mda = $3; }
+		| CONFIG_CACHE map DISABLED	{ config_cache = 0; }
+		| CONFIG_CACHE map ENABLED	{ config_cache = 1; }
+		| LMTP map STRING	{ lmtp = $3; }
+		| MDA_WORKERS map NUMBER	{ mda_workers = $3; }
+		| LOCALDOMAIN map STRING	{ local_domain_add($3); }
+		| LOCALRESOLVE map DISABLED	{ local_resolve = 0; }
+		| LOCALRESOLVE map ENABLED	{ local_resolve = 1; }
+		| LONG_LINES map ENABLED	{ long_lines = Long_lines_ALLOW; }
+		| LONG_LINES map FOLD	{ long_lines = Long_lines_FOLD; }
+		| LONG_LINES map REJECT	{ long_lines = Long_lines_REJECT; }
+		| BODY_TYPE map DISABLED	{ body_type_auto = 0; }
+		| BODY_TYPE map AUTO	{ body_type_auto = 1; }
+		| MSGSIZE map DISABLED	{ declare_size = 0; }
+		| MSGSIZE map ENABLED	{ declare_size = 1; }
+		| CHUNKSIZE map NUMBER
+			{
+				if ($3 <= 0)
+					yyerror("chunksize must be positive");
+				chunk_size = $3;
+			}
+		| QUEUEDIR map STRING	{ queue_dir = $3; }
+		| DEFAULT		{ if(!identity->route) default_identity = identity; }
 		;
 
 %%
@@ -279,12 +352,27 @@ void rcfile_parse(const char *_rcfile)
 success:
 	/* Configuration file opened */
 	
-	identity = identity_new();
-	identity_add(identity);
+	if (!config_arena)
+		config_arena = arena_new();
+
+	if (!rccache_load(rcfile))
+	{
+		identity_t *global;
+
+		global = identity = identity_new();
+		identity_add(identity);
+
+		yyparse();	/* parse entire file */
 
-	yyparse();	/* parse entire file */
+		SET_DEFAULT_IDENTITY;
+		if (!default_identity)
+			default_identity = global;
 
-	SET_DEFAULT_IDENTITY;
+		if (config_cache)
+			rccache_save(rcfile);
+		else
+			rccache_remove(rcfile);
+	}
 
 	fclose(yyin);	/* not checking this should be safe, file mode was r */
 
@@ -300,5 +388,16 @@ failure:
 	exit(EX_CONFIG);
 }
 
+void rcfile_cleanup(void)
+{
+	if (config_arena)
+	{
+		arena_free(config_arena);
+		config_arena = NULL;
+	}
+
+	mda = force_mda = lmtp = queue_dir = NULL;
+}
+
 /* easier to do this than cope with variations in where the library lives */
 int yywrap(void) { return 1; }
@@ -0,0 +1,2952 @@
+/**
+ * \file queue.c
+ * Mail queue.
+ *
+ * Each queued message is a pair of files in one of the shard subdirectories
+ * of the queue directory, named after sendmail's: "df<id>" holds the message
+ * as spooled by message_spool(), i.e., with CRLF newlines and without its
+ * Bcc: header, and "qf<id>" its envelope.  The envelope is written under a
+ * temporary name and renamed into place, so that a message is only ever seen
+ * in the queue once it is complete.
+ *
+ * The envelope starts with a fixed size header, which is updated in place
+ * after each delivery attempt, followed by the reverse path, the envelope id,
+ * the recipients and the priority, stored as in the configuration cache.
+ *
+ * Queue runs lock each envelope with flock() while delivering it, so that
+ * concurrent runs skip the messages already being delivered.
+ *
+ * An index of the queue, kept alongside, answers mailq without opening any
+ * queued message.
+ */
+
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pwd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "queue.h"
+#include "main.h"
+#include "xmalloc.h"
+
+
+char *queue_dir = NULL;
+
+#define QUEUE_DIR	".esmtp_spool"
+#define QUEUE_MAGIC	"ESMTPQ"
+#define QUEUE_VERSION	1
+
+/** Lane of a priority, from 0 for the most urgent */
+#define QUEUE_LANE(priority)	((priority) - Priority_URGENT)
+#define QUEUE_LANES		3
+
+/** Envelope header */
+typedef struct {
+	char magic[8];
+	unsigned version;
+	time_t ctime;		/**< when queued */
+	time_t next_try;	/**< when to try again */
+	int attempts;		/**< delivery attempts so far */
+	unsigned long size;	/**< size of the data file */
+	size_t longest_line;
+	int eightbit;
+	int body;		/**< enum e8bitmime_body */
+	int ret;		/**< enum ret_flags */
+	int notify;		/**< enum notify_flags */
+} queue_header_t;
+
+
+const char *queue_directory(void)
+{
+	static char *dir = NULL;
+
+	if (!dir)
+	{
+		if (queue_dir)
+			dir = xstrdup(queue_dir);
+		else
+		{
+			char *home;
+
+			if (!(home = getenv("HOME")))
+			{
+				fprintf(stderr, "No queue directory, HOME is not set\n");
+				exit(EX_CONFIG);
+			}
+
+			dir = xmalloc(strlen(home) + strlen(QUEUE_DIR) + 2);
+			strcpy(dir, home);
+			if (dir[0] && dir[strlen(dir) - 1] != '/')
+				strcat(dir, "/");
+			strcat(dir, QUEUE_DIR);
+		}
+
+		if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		{
+			fprintf(stderr, "mkdir: %s: %s\n", dir, strerror(errno));
+			exit(EX_CANTCREAT);
+		}
+	}
+
+	return dir;
+}
+
+/**
+ * \name Shards
+ *
+ * The messages are spread over #QUEUE_SHARDS subdirectories, so that none
+ * grows too large to be searched quickly, and so that the queue runs can
+ * deliver each on its own.  The shard is the hexadecimal digit following the
+ * time in the id, and messages queued before sharding, whose ids have none,
+ * stay at the top of the queue directory.
+ */
+/*@{*/
+
+#define QUEUE_SHARDS	16	/**< shard subdirectories */
+#define QUEUE_ID_LENGTH	15	/**< time, shard and mkstemp() suffix */
+#define QUEUE_ID_SIZE	16	/**< room for an id */
+
+/** Shard of a message, or -1 if it isn't in one */
+static int queue_shard(const char *id)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	const char *p;
+
+	if (strlen(id) != QUEUE_ID_LENGTH || !(p = strchr(digits, id[8])))
+		return -1;
+
+	return p - digits;
+}
+
+/** Directory of a shard, created if needed, to be freed by the caller */
+static char *queue_shard_directory(int shard)
+{
+	const char *dir = queue_directory();
+	char *path;
+
+	path = xmalloc(strlen(dir) + 4);
+	sprintf(path, "%s/%X", dir, shard);
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "mkdir: %s: %s\n", path, strerror(errno));
+		exit(EX_CANTCREAT);
+	}
+
+	return path;
+}
+
+/**
+ * Path of a queue file, in the shard of \p id if it has one, to be freed by
+ * the caller.
+ */
+static char *queue_path(const char *prefix, const char *id)
+{
+	const char *dir = queue_directory();
+	int shard = queue_shard(id);
+	char *path;
+
+	path = xmalloc(strlen(dir) + strlen(prefix) + strlen(id) + 4);
+	if (shard < 0)
+		sprintf(path, "%s/%s%s", dir, prefix, id);
+	else
+		sprintf(path, "%s/%X/%s%s", dir, shard, prefix, id);
+
+	return path;
+}
+
+/** Make the directory entries of a message durable */
+static void queue_sync_dir(const char *id)
+{
+	char *path;
+	int fd;
+
+	path = queue_path("", id);
+	*strrchr(path, '/') = '\0';
+
+	if ((fd = open(path, O_RDONLY)) >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+
+	free(path);
+}
+
+/*@}*/
+
+
+/**
+ * \name Journal
+ *
+ * Small messages are made durable by a group commit rather than by syncing
+ * their own files: their envelope and data are appended to a journal shared
+ * by all the submitters, and whoever syncs it first does so for all the
+ * records appended meanwhile, the others finding theirs already synced.  The
+ * message files themselves are written without syncing them.
+ *
+ * Queue runs checkpoint the journal: they write back the messages whose files
+ * were lost in a crash, sync the files of the others and empty it.  Removing
+ * a message still in the journal appends a record too, so that it isn't
+ * brought back.
+ */
+/*@{*/
+
+#define QUEUE_JOURNAL		"journal"
+#define QUEUE_JOURNAL_SYNC	"journal.sync"
+#define QUEUE_JOURNAL_MAGIC	"ESMTPQJ"
+#define QUEUE_JOURNAL_LARGE	(256 * 1024)		/**< largest message journaled */
+#define QUEUE_JOURNAL_CHECKPOINT (4 * 1024 * 1024)	/**< size worth a checkpoint by a run */
+#define QUEUE_JOURNAL_MAX	(64 * 1024 * 1024)	/**< size forcing one by a submitter */
+
+enum {
+	Journal_ADD,
+	Journal_DONE
+};
+
+/** Journal header, with a new generation after each checkpoint */
+typedef struct {
+	char magic[8];
+	unsigned version;
+	unsigned long generation;
+} queue_journal_header_t;
+
+/** Journal record, followed by the envelope and the data of the message */
+typedef struct {
+	unsigned op;
+	char id[QUEUE_ID_SIZE];
+	unsigned checksum;	/**< of what follows */
+	size_t envelope;
+	size_t data;
+} queue_journal_record_t;
+
+/** How far the journal is known to be synced, kept in QUEUE_JOURNAL_SYNC */
+typedef struct {
+	unsigned long generation;
+	off_t synced;
+} queue_journal_state_t;
+
+/** FNV-1a, to tell the records torn by a crash */
+static unsigned queue_checksum(const char *p, size_t n)
+{
+	unsigned h = 2166136261U;
+
+	while (n--)
+		h = (h ^ (unsigned char)*p++) * 16777619U;
+
+	return h;
+}
+
+/** Write a whole file, without syncing it */
+static void queue_write_file(const char *path, const char *data, size_t length, int flags)
+{
+	ssize_t count;
+	size_t done;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | flags, 0600)) < 0)
+	{
+		fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+		exit(EX_CANTCREAT);
+	}
+
+	for (done = 0; done < length; done += count)
+		if ((count = write(fd, data + done, length - done)) < 0)
+		{
+			perror(path);
+			unlink(path);
+			exit(EX_IOERR);
+		}
+
+	if (close(fd) < 0)
+	{
+		perror(path);
+		unlink(path);
+		exit(EX_IOERR);
+	}
+}
+
+/** Sync a file, if it exists */
+static void queue_sync_file(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/**
+ * Write an envelope under a temporary name and rename it into place,
+ * syncing it first if \p durable.
+ */
+static void queue_write_envelope(const char *id, const char *envelope, size_t length, int durable)
+{
+	char *tf, *qf;
+
+	tf = queue_path("tf", id);
+	qf = queue_path("qf", id);
+
+	queue_write_file(tf, envelope, length, O_TRUNC);
+	if (durable)
+		queue_sync_file(tf);
+
+	if (rename(tf, qf) < 0)
+	{
+		perror(tf);
+		unlink(tf);
+		exit(EX_IOERR);
+	}
+
+	if (durable)
+		queue_sync_dir(id);
+
+	free(tf);
+	free(qf);
+}
+
+/**
+ * Open and lock the journal, starting a new one if it's missing or damaged.
+ *
+ * \param create whether to create it if missing.
+ *
+ * \return -1 if it's missing and not created.
+ */
+static int queue_journal_open(int create, queue_journal_header_t *header)
+{
+	char *path;
+	int fd;
+
+	path = queue_path(QUEUE_JOURNAL, "");
+	if ((fd = open(path, O_RDWR | O_APPEND | (create ? O_CREAT : 0), 0600)) < 0)
+	{
+		if (create || errno != ENOENT)
+		{
+			fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+			exit(EX_CANTCREAT);
+		}
+		free(path);
+		return -1;
+	}
+	free(path);
+
+	if (flock(fd, LOCK_EX) < 0)
+	{
+		perror("flock");
+		exit(EX_OSERR);
+	}
+
+	/* No record was acknowledged before the header was synced with it */
+	if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+	    memcmp(header->magic, QUEUE_JOURNAL_MAGIC, sizeof(QUEUE_JOURNAL_MAGIC)) ||
+	    header->version != QUEUE_VERSION)
+	{
+		memset(header, 0, sizeof(*header));
+		memcpy(header->magic, QUEUE_JOURNAL_MAGIC, sizeof(QUEUE_JOURNAL_MAGIC));
+		header->version = QUEUE_VERSION;
+		header->generation = time(NULL);
+
+		if (ftruncate(fd, 0) < 0 || write(fd, header, sizeof(*header)) != sizeof(*header))
+		{
+			perror(QUEUE_JOURNAL);
+			exit(EX_IOERR);
+		}
+	}
+
+	return fd;
+}
+
+/**
+ * Wait until the journal is synced up to \p end, syncing it if nobody did
+ * yet, for all the records appended so far.
+ */
+static void queue_journal_sync(int fd, unsigned long generation, off_t end)
+{
+	queue_journal_header_t header;
+	queue_journal_state_t state;
+	struct stat statbuf;
+	char *path;
+	int sfd;
+
+	path = queue_path(QUEUE_JOURNAL_SYNC, "");
+	if ((sfd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+	{
+		fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+		exit(EX_CANTCREAT);
+	}
+	free(path);
+
+	if (flock(sfd, LOCK_EX) < 0)
+	{
+		perror("flock");
+		exit(EX_OSERR);
+	}
+
+	if (pread(sfd, &state, sizeof(state), 0) != sizeof(state))
+		memset(&state, 0, sizeof(state));
+
+	/* A checkpoint since synced the message files themselves */
+	if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.generation == generation &&
+	    (state.generation != generation || state.synced < end))
+	{
+		if (fstat(fd, &statbuf) < 0 || fdatasync(fd) < 0)
+		{
+			perror(QUEUE_JOURNAL);
+			exit(EX_IOERR);
+		}
+
+		state.generation = generation;
+		state.synced = statbuf.st_size;
+		if (pwrite(sfd, &state, sizeof(state), 0) != sizeof(state))
+			perror(QUEUE_JOURNAL_SYNC);
+	}
+
+	close(sfd);
+}
+
+/** \name Ids added to the journal since its last checkpoint, as far as read */
+/*@{*/
+static hash_t *queue_journaled = NULL;
+static unsigned long queue_journaled_generation;
+static off_t queue_journaled_end;
+/*@}*/
+
+/**
+ * Whether the journal holds a message, reading the records appended to it
+ * since last asked.  Only their headers are read, the checkpoints ignoring
+ * whatever follows a torn one anyway.
+ */
+static int queue_journal_holds(int fd, const queue_journal_header_t *header, const char *id)
+{
+	queue_journal_record_t record;
+	struct stat statbuf;
+
+	if (!queue_journaled || queue_journaled_generation != header->generation)
+	{
+		if (queue_journaled)
+			hash_free(queue_journaled);
+		queue_journaled = hash_new();
+		queue_journaled_generation = header->generation;
+		queue_journaled_end = sizeof(*header);
+	}
+
+	if (fstat(fd, &statbuf) < 0)
+		return 1;
+
+	while (queue_journaled_end + (off_t)sizeof(record) <= statbuf.st_size &&
+	       pread(fd, &record, sizeof(record), queue_journaled_end) == sizeof(record) &&
+	       (record.op == Journal_ADD || record.op == Journal_DONE))
+	{
+		if (record.op == Journal_ADD && !record.id[QUEUE_ID_SIZE - 1])
+			hash_insert(queue_journaled, record.id, queue_journaled);
+		queue_journaled_end += sizeof(record) + record.envelope + record.data;
+	}
+
+	return hash_lookup(queue_journaled, id) != NULL;
+}
+
+/** Record that a message was removed, so that a checkpoint leaves it out */
+static void queue_journal_done(const char *id)
+{
+	queue_journal_header_t header;
+	queue_journal_record_t record;
+	int fd;
+
+	if ((fd = queue_journal_open(0, &header)) < 0)
+		return;
+
+	/* Synced on its own, or by a checkpoint already */
+	if (!queue_journal_holds(fd, &header, id))
+	{
+		close(fd);
+		return;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.op = Journal_DONE;
+	strcpy(record.id, id);
+	record.checksum = queue_checksum(NULL, 0);
+
+	if (write(fd, &record, sizeof(record)) != sizeof(record))
+		perror(QUEUE_JOURNAL);
+
+	close(fd);
+}
+
+/** The next record, or NULL at the end or at a torn record */
+static const char *queue_journal_next(const char **p, const char *end, queue_journal_record_t *record)
+{
+	const char *payload;
+
+	if (end - *p < (ptrdiff_t)sizeof(*record))
+		return NULL;
+	memcpy(record, *p, sizeof(*record));
+	payload = *p + sizeof(*record);
+
+	if ((record->op != Journal_ADD && record->op != Journal_DONE) ||
+	    record->id[QUEUE_ID_SIZE - 1] ||
+	    record->envelope > (size_t)(end - payload) ||
+	    record->data > (size_t)(end - payload) - record->envelope ||
+	    record->checksum != queue_checksum(payload, record->envelope + record->data))
+		return NULL;
+
+	*p = payload + record->envelope + record->data;
+
+	return payload;
+}
+
+/** Whether a file differs from \p data, past its first \p skip octets */
+static int queue_file_differs(const char *path, const char *data, size_t length, size_t skip)
+{
+	char buffer[8192];
+	size_t done;
+	ssize_t count = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 1;
+
+	for (done = skip; done < length; done += count)
+	{
+		size_t n = length - done < sizeof(buffer) ? length - done : sizeof(buffer);
+
+		if ((count = pread(fd, buffer, n, done)) <= 0 || memcmp(buffer, data + done, count))
+			break;
+	}
+
+	/* and no longer */
+	if (done == length && pread(fd, buffer, 1, length) != 0)
+		count = -1;
+
+	close(fd);
+
+	return done < length || count < 0;
+}
+
+/** Write back the files of a journaled message if damaged, and sync them */
+static void queue_journal_restore(const queue_journal_record_t *record, const char *payload)
+{
+	char *qf, *df;
+	int fd;
+
+	qf = queue_path("qf", record->id);
+	df = queue_path("df", record->id);
+
+	/* Unless being delivered, which it couldn't be if damaged */
+	if ((fd = open(qf, O_RDONLY)) < 0 || flock(fd, LOCK_EX | LOCK_NB) == 0)
+	{
+		if (queue_file_differs(df, payload + record->envelope, record->data, 0))
+			queue_write_file(df, payload + record->envelope, record->data, O_TRUNC);
+
+		/* the header is updated by the queue runs */
+		if (fd < 0 || queue_file_differs(qf, payload, record->envelope, sizeof(queue_header_t)))
+		{
+			if (verbose)
+				fprintf(stderr, "%s: restored from the journal\n", record->id);
+			queue_write_envelope(record->id, payload, record->envelope, 0);
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	queue_sync_file(df);
+	queue_sync_file(qf);
+
+	free(qf);
+	free(df);
+}
+
+/** Write back and sync the journaled messages, then empty the journal */
+static void queue_journal_checkpoint(void)
+{
+	queue_journal_header_t header;
+	queue_journal_record_t record;
+	struct stat statbuf;
+	const char *p, *end, *payload;
+	void *map = MAP_FAILED;
+	hash_t *done;
+	char *path;
+	int fd, shard;
+
+	if ((fd = queue_journal_open(0, &header)) < 0)
+		return;
+
+	if (fstat(fd, &statbuf) < 0)
+	{
+		perror(QUEUE_JOURNAL);
+		exit(EX_IOERR);
+	}
+
+	if (statbuf.st_size > (off_t)sizeof(header))
+	{
+		if ((map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		{
+			perror(QUEUE_JOURNAL);
+			exit(EX_IOERR);
+		}
+		end = (const char *)map + statbuf.st_size;
+
+		/* The messages removed since, not to be brought back */
+		done = hash_new();
+		for (p = (const char *)map + sizeof(header); queue_journal_next(&p, end, &record); )
+			if (record.op == Journal_DONE)
+				hash_insert(done, record.id, done);
+
+		for (p = (const char *)map + sizeof(header); (payload = queue_journal_next(&p, end, &record)); )
+			if (record.op == Journal_ADD && !hash_lookup(done, record.id))
+				queue_journal_restore(&record, payload);
+
+		hash_free(done);
+		munmap(map, statbuf.st_size);
+
+		for (shard = 0; shard < QUEUE_SHARDS; shard++)
+		{
+			path = queue_shard_directory(shard);
+			queue_sync_file(path);
+			free(path);
+		}
+	}
+
+	/* Start afresh, telling the submitters waiting that it was synced */
+	header.generation++;
+	if (ftruncate(fd, 0) < 0 || write(fd, &header, sizeof(header)) != sizeof(header) || fdatasync(fd) < 0)
+	{
+		perror(QUEUE_JOURNAL);
+		exit(EX_IOERR);
+	}
+
+	close(fd);
+}
+
+/** Checkpoint the journal if it grew past \p size */
+static void queue_journal_check(off_t size)
+{
+	struct stat statbuf;
+	char *path;
+
+	path = queue_path(QUEUE_JOURNAL, "");
+	if (stat(path, &statbuf) == 0 && statbuf.st_size > size)
+		queue_journal_checkpoint();
+	free(path);
+}
+
+/**
+ * Queue a message through the journal: append it, write its envelope without
+ * syncing it, and wait for the group commit.
+ */
+static void queue_journal_commit(const char *id, const char *envelope, size_t length, FILE *data)
+{
+	queue_journal_header_t header;
+	queue_journal_record_t record;
+	struct stat statbuf;
+	char *buffer;
+	size_t total;
+	off_t end;
+	int fd;
+
+	if (fstat(fileno(data), &statbuf) < 0)
+	{
+		perror("fstat");
+		exit(EX_IOERR);
+	}
+
+	/* The record in one piece, for a single write() */
+	total = sizeof(record) + length + statbuf.st_size;
+	buffer = xmalloc(total);
+	memcpy(buffer + sizeof(record), envelope, length);
+	if (pread(fileno(data), buffer + sizeof(record) + length, statbuf.st_size, 0) != statbuf.st_size)
+	{
+		perror("pread");
+		exit(EX_IOERR);
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.op = Journal_ADD;
+	strcpy(record.id, id);
+	record.envelope = length;
+	record.data = statbuf.st_size;
+	record.checksum = queue_checksum(buffer + sizeof(record), total - sizeof(record));
+	memcpy(buffer, &record, sizeof(record));
+
+	fd = queue_journal_open(1, &header);
+
+	end = lseek(fd, 0, SEEK_END);
+	if (write(fd, buffer, total) != (ssize_t)total)
+	{
+		perror(QUEUE_JOURNAL);
+		/* not to hide the records appended after it */
+		if (ftruncate(fd, end) < 0)
+			perror(QUEUE_JOURNAL);
+		exit(EX_IOERR);
+	}
+	end += total;
+	free(buffer);
+
+	/* Seen by the queue runs from now on, and durable once synced, but
+	 * never before a checkpoint could bring it back */
+	queue_write_envelope(id, envelope, length, 0);
+
+	flock(fd, LOCK_UN);
+	queue_journal_sync(fd, header.generation, end);
+	close(fd);
+
+	if (end > QUEUE_JOURNAL_MAX)
+		queue_journal_checkpoint();
+}
+
+/*@}*/
+
+
+/**
+ * \name Reading
+ */
+/*@{*/
+
+/** Reading cursor over an envelope */
+typedef struct {
+	const char *p, *end;
+	int error;
+} cursor_t;
+
+static int get_int(cursor_t *c)
+{
+	int value;
+
+	if (c->error || c->end - c->p < (ptrdiff_t)sizeof(value))
+	{
+		c->error = 1;
+		return 0;
+	}
+
+	memcpy(&value, c->p, sizeof(value));
+	c->p += sizeof(value);
+
+	return value;
+}
+
+static const char *get_string(cursor_t *c)
+{
+	const char *s;
+	int len;
+
+	if (!(len = get_int(c)))
+		return NULL;
+
+	if (c->error || len < 0 || c->end - c->p < len || c->p[len - 1] != '\0')
+	{
+		c->error = 1;
+		return NULL;
+	}
+
+	s = c->p;
+	c->p += len;
+
+	return s;
+}
+
+/** A queued message, as read back from its envelope */
+typedef struct {
+	char *id;
+	int fd;			/**< envelope, locked while delivering */
+	queue_header_t header;
+	char *data;		/**< envelope after the header */
+	cursor_t cursor;	/**< over the data, at the recipients */
+	const char *reverse_path;
+	const char *envid;
+	int nrecipients;
+	enum priority priority;
+} queue_entry_t;
+
+/**
+ * Open and read the envelope of a queued message.
+ *
+ * \param lock whether to lock it, failing if it's already locked.
+ *
+ * \return zero on success, 1 if it's locked already, -1 otherwise.
+ */
+static int queue_entry_open(queue_entry_t *entry, const char *id, int lock)
+{
+	struct stat statbuf;
+	cursor_t c;
+	char *qf;
+	size_t size;
+	int i;
+
+	memset(entry, 0, sizeof(queue_entry_t));
+	entry->id = xstrdup(id);
+
+	qf = queue_path("qf", id);
+	entry->fd = open(qf, lock ? O_RDWR : O_RDONLY);
+	free(qf);
+	if (entry->fd < 0)
+		goto failure;
+
+	if (lock && flock(entry->fd, LOCK_EX | LOCK_NB) < 0)
+	{
+		if (verbose)
+			fprintf(stdout, "%s: being delivered\n", id);
+		close(entry->fd);
+		free(entry->id);
+		return 1;
+	}
+
+	/* delivered by someone else meanwhile */
+	if (fstat(entry->fd, &statbuf) < 0 || statbuf.st_nlink == 0)
+		goto failure;
+
+	if (statbuf.st_size < (off_t)sizeof(queue_header_t))
+		goto damaged;
+
+	size = statbuf.st_size - sizeof(queue_header_t);
+	entry->data = xmalloc(size ? size : 1);
+	if (read(entry->fd, &entry->header, sizeof(queue_header_t)) != sizeof(queue_header_t) ||
+	    read(entry->fd, entry->data, size) != (ssize_t)size)
+		goto damaged;
+
+	if (memcmp(entry->header.magic, QUEUE_MAGIC, sizeof(QUEUE_MAGIC)) ||
+	    entry->header.version != QUEUE_VERSION)
+		goto damaged;
+
+	entry->cursor.p = entry->data;
+	entry->cursor.end = entry->data + size;
+	entry->reverse_path = get_string(&entry->cursor);
+	entry->envid = get_string(&entry->cursor);
+	entry->nrecipients = get_int(&entry->cursor);
+	if (entry->cursor.error || entry->nrecipients < 0)
+		goto damaged;
+
+	/* The priority follows the recipients, but for the messages queued
+	 * before there were lanes */
+	c = entry->cursor;
+	for (i = 0; i < entry->nrecipients; i++)
+		get_string(&c);
+	entry->priority = c.p < c.end ? get_int(&c) : Priority_NORMAL;
+	if (c.error || entry->priority < Priority_URGENT || entry->priority > Priority_BULK)
+		goto damaged;
+
+	return 0;
+
+damaged:
+	fprintf(stderr, "%s: damaged queue file\n", id);
+failure:
+	if (entry->fd >= 0)
+		close(entry->fd);
+	free(entry->data);
+	free(entry->id);
+	return -1;
+}
+
+static void queue_entry_close(queue_entry_t *entry)
+{
+	close(entry->fd);
+	free(entry->data);
+	free(entry->id);
+}
+
+/** Make a message out of a queued one, to deliver it */
+static message_t *queue_entry_message(queue_entry_t *entry)
+{
+	message_t *message;
+	cursor_t c = entry->cursor;
+	int i;
+
+	message = message_new();
+
+	if (entry->reverse_path)
+		message_set_reverse_path(message, entry->reverse_path);
+	if (entry->envid)
+		message_set_envid(message, entry->envid);
+
+	for (i = 0; i < entry->nrecipients; i++)
+		message_add_recipient(message, get_string(&c));
+
+	message->ret = (enum ret_flags)entry->header.ret;
+	message->notify = (enum notify_flags)entry->header.notify;
+	message->body = (enum e8bitmime_body)entry->header.body;
+
+	/* as if just spooled */
+	message->spool_path = queue_path("df", entry->id);
+	message->spool_crlf = 1;
+	message->spool_keep = 1;
+	message->size = entry->header.size;
+	message->longest_line = entry->header.longest_line;
+	message->eightbit = entry->header.eightbit;
+
+	if (!(message->fp = fopen(message->spool_path, "r")))
+	{
+		perror(message->spool_path);
+		exit(EX_NOINPUT);
+	}
+
+	return message;
+}
+
+/** Update the envelope header in place */
+static void queue_entry_update(queue_entry_t *entry)
+{
+	if (pwrite(entry->fd, &entry->header, sizeof(queue_header_t), 0) != sizeof(queue_header_t))
+		fprintf(stderr, "%s: %s\n", entry->id, strerror(errno));
+}
+
+/** Remove a delivered message, envelope first */
+static void queue_entry_remove(queue_entry_t *entry)
+{
+	char *path;
+
+	if (entry->header.size <= QUEUE_JOURNAL_LARGE)
+		queue_journal_done(entry->id);
+
+	path = queue_path("qf", entry->id);
+	unlink(path);
+	free(path);
+
+	path = queue_path("df", entry->id);
+	unlink(path);
+	free(path);
+}
+
+/** Ids start with the time they were queued, so they sort by age */
+static int queue_id_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/** Add the ids of the envelopes in \p path to \p ids */
+static char **queue_ids_scan(const char *path, char **ids, int *n, int *size)
+{
+	struct dirent *dirent;
+	DIR *dir;
+
+	if ((dir = opendir(path)))
+	{
+		while ((dirent = readdir(dir)))
+		{
+			if (strncmp(dirent->d_name, "qf", 2) || !dirent->d_name[2])
+				continue;
+
+			if (*n + 1 == *size)
+			{
+				*size *= 2;
+				ids = (char **)xrealloc(ids, *size * sizeof(char *));
+			}
+			ids[(*n)++] = xstrdup(dirent->d_name + 2);
+		}
+		closedir(dir);
+	}
+
+	return ids;
+}
+
+/** Ids of the queued messages, oldest first, NULL terminated */
+static char **queue_ids(void)
+{
+	const char *dir = queue_directory();
+	char **ids, *path;
+	int n = 0, size = 16, shard;
+
+	ids = (char **)xmalloc(size * sizeof(char *));
+
+	/* those queued before sharding, then the shards */
+	ids = queue_ids_scan(dir, ids, &n, &size);
+
+	path = xmalloc(strlen(dir) + 4);
+	for (shard = 0; shard < QUEUE_SHARDS; shard++)
+	{
+		sprintf(path, "%s/%X", dir, shard);
+		ids = queue_ids_scan(path, ids, &n, &size);
+	}
+	free(path);
+
+	ids[n] = NULL;
+
+	qsort(ids, n, sizeof(char *), queue_id_compare);
+
+	return ids;
+}
+
+static void queue_ids_free(char **ids)
+{
+	char **p;
+
+	for (p = ids; *p; p++)
+		free(*p);
+	free(ids);
+}
+
+/*@}*/
+
+
+/**
+ * \name Index
+ *
+ * The index lets the queue be listed, counted and searched without opening
+ * the queued messages.  It's a log of records adding, updating or removing a
+ * message, each appended with a single write() under an exclusive lock, which
+ * is replayed when read.  Queue runs rewrite it once it's mostly made of dead
+ * records, renaming the new one into place; writers notice by finding the
+ * index they locked unlinked.
+ *
+ * The index is only a cache of the envelopes: when missing, damaged or out of
+ * step with them, e.g., after a crash between queueing a message and indexing
+ * it, it's rebuilt from them.
+ */
+/*@{*/
+
+#define QUEUE_INDEX		"index"
+#define QUEUE_INDEX_MAGIC	"ESMTPQI"
+#define QUEUE_INDEX_VERSION	2
+
+enum {
+	Record_ADD,
+	Record_UPDATE,
+	Record_REMOVE
+};
+
+/** Index record, followed when adding by the sender and the recipients */
+typedef struct {
+	int op;
+	char id[QUEUE_ID_SIZE];
+	time_t ctime;
+	time_t next_try;
+	int attempts;
+	unsigned long size;
+	int priority;
+	int nrecipients;
+	unsigned length;	/**< of the strings following */
+} queue_record_t;
+
+typedef struct {
+	char magic[8];
+	unsigned version;
+} queue_index_header_t;
+
+/** A queued message, as known by the index */
+typedef struct {
+	struct list_head list;
+	char *id;
+	time_t ctime;
+	time_t next_try;
+	int attempts;
+	unsigned long size;
+	enum priority priority;
+	char *sender;		/**< empty for the default identity */
+	int nrecipients;
+	char **recipients;
+	int removed;
+} queue_index_entry_t;
+
+typedef struct {
+	arena_t *arena;
+	hash_t *entries;	/**< by id, including the removed ones */
+	struct list_head list;	/**< the queued ones, in queueing order */
+	int count;		/**< queued messages */
+	int records;		/**< records in the log */
+} queue_index_t;
+
+/**
+ * Pack a record with its strings into a single buffer, to be freed by the
+ * caller.
+ */
+static char *queue_record_pack(queue_record_t *record, const char *sender,
+                               char * const *recipients, size_t *size)
+{
+	char *buffer, *p;
+	int i;
+
+	record->length = 0;
+	if (record->op == Record_ADD)
+	{
+		record->length = strlen(sender ? sender : "") + 1;
+		for (i = 0; i < record->nrecipients; i++)
+			record->length += strlen(recipients[i]) + 1;
+	}
+
+	*size = sizeof(queue_record_t) + record->length;
+	buffer = xmalloc(*size);
+	memcpy(buffer, record, sizeof(queue_record_t));
+
+	p = buffer + sizeof(queue_record_t);
+	if (record->op == Record_ADD)
+	{
+		strcpy(p, sender ? sender : "");
+		p += strlen(p) + 1;
+		for (i = 0; i < record->nrecipients; i++)
+		{
+			strcpy(p, recipients[i]);
+			p += strlen(p) + 1;
+		}
+	}
+
+	return buffer;
+}
+
+static void queue_record_init(queue_record_t *record, int op, const char *id)
+{
+	memset(record, 0, sizeof(queue_record_t));
+	record->op = op;
+	assert(strlen(id) < QUEUE_ID_SIZE);
+	strcpy(record->id, id);
+}
+
+static queue_index_t *queue_index_new(void)
+{
+	queue_index_t *index;
+
+	index = (queue_index_t *)xmalloc(sizeof(queue_index_t));
+	index->arena = arena_new();
+	index->entries = hash_new();
+	INIT_LIST_HEAD(&index->list);
+	index->count = 0;
+	index->records = 0;
+
+	return index;
+}
+
+static void queue_index_free(queue_index_t *index)
+{
+	hash_free(index->entries);
+	arena_free(index->arena);
+	free(index);
+}
+
+static queue_index_entry_t *queue_index_entry_new(queue_index_t *index, const char *id)
+{
+	queue_index_entry_t *entry;
+
+	entry = (queue_index_entry_t *)arena_alloc(index->arena, sizeof(queue_index_entry_t));
+	memset(entry, 0, sizeof(queue_index_entry_t));
+	entry->id = arena_strdup(index->arena, id);
+	hash_insert(index->entries, entry->id, entry);
+
+	return entry;
+}
+
+/**
+ * Apply a record.
+ *
+ * \return zero if it's malformed.
+ */
+static int queue_index_apply(queue_index_t *index, const queue_record_t *record, const char *strings)
+{
+	queue_index_entry_t *entry;
+	char id[QUEUE_ID_SIZE], *p, *end;
+	int i;
+
+	if (!memchr(record->id, '\0', QUEUE_ID_SIZE))
+		return 0;
+	strcpy(id, record->id);
+
+	index->records++;
+	entry = (queue_index_entry_t *)hash_lookup(index->entries, id);
+
+	switch (record->op)
+	{
+		case Record_ADD:
+			/* Indexed twice, by a rebuild racing with the queueing, or
+			 * indexed after being delivered */
+			if (entry)
+				return 1;
+
+			if (record->nrecipients < 0 ||
+			    record->priority < Priority_URGENT || record->priority > Priority_BULK)
+				return 0;
+
+			entry = queue_index_entry_new(index, id);
+			entry->ctime = record->ctime;
+			entry->next_try = record->next_try;
+			entry->attempts = record->attempts;
+			entry->size = record->size;
+			entry->priority = record->priority;
+			entry->nrecipients = record->nrecipients;
+			entry->recipients = (char **)arena_alloc(index->arena,
+				entry->nrecipients * sizeof(char *));
+
+			p = (char *)memcpy(arena_alloc(index->arena, record->length),
+			                   strings, record->length);
+			end = p + record->length;
+			for (i = -1; i < entry->nrecipients; i++)
+			{
+				char *q;
+
+				if (!(q = memchr(p, '\0', end - p)))
+					return 0;
+				if (i < 0)
+					entry->sender = p;
+				else
+					entry->recipients[i] = p;
+				p = q + 1;
+			}
+			if (p != end)
+				return 0;
+
+			list_add_tail(&entry->list, &index->list);
+			index->count++;
+			break;
+
+		case Record_UPDATE:
+			if (entry && !entry->removed)
+			{
+				entry->attempts = record->attempts;
+				entry->next_try = record->next_try;
+			}
+			break;
+
+		case Record_REMOVE:
+			/* Remember it, in case it's indexed late */
+			if (!entry)
+				entry = queue_index_entry_new(index, id);
+			else if (!entry->removed)
+			{
+				list_del(&entry->list);
+				index->count--;
+			}
+			entry->removed = 1;
+			break;
+
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+/** Open and lock the index, creating it if needed */
+static int queue_index_open(int operation)
+{
+	struct stat statbuf;
+	char *path;
+	int fd;
+
+	path = queue_path(QUEUE_INDEX, "");
+
+	for (;;)
+	{
+		if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0)
+		{
+			fprintf(stderr, "open: %s: %s\n", path, strerror(errno));
+			exit(EX_CANTCREAT);
+		}
+
+		if (flock(fd, operation) < 0)
+		{
+			perror("flock");
+			exit(EX_OSERR);
+		}
+
+		/* unless replaced while waiting for the lock */
+		if (fstat(fd, &statbuf) == 0 && statbuf.st_nlink > 0)
+			break;
+
+		close(fd);
+	}
+
+	free(path);
+
+	return fd;
+}
+
+/**
+ * Read the index.
+ *
+ * \return NULL if it's empty or damaged.
+ */
+static queue_index_t *queue_index_read(int fd)
+{
+	queue_index_header_t expected;
+	queue_index_t *index;
+	struct stat statbuf;
+	const char *p, *end;
+	void *map;
+
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t)sizeof(queue_index_header_t) ||
+	    (map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		return NULL;
+
+	memset(&expected, 0, sizeof(expected));
+	memcpy(expected.magic, QUEUE_INDEX_MAGIC, sizeof(QUEUE_INDEX_MAGIC));
+	expected.version = QUEUE_INDEX_VERSION;
+
+	index = queue_index_new();
+
+	if (memcmp(map, &expected, sizeof(expected)))
+		goto damaged;
+
+	p = (const char *)map + sizeof(queue_index_header_t);
+	end = (const char *)map + statbuf.st_size;
+	while (p < end)
+	{
+		queue_record_t record;
+
+		if (end - p < (ptrdiff_t)sizeof(record))
+			goto damaged;
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+
+		if (record.length > (size_t)(end - p) || !queue_index_apply(index, &record, p))
+			goto damaged;
+		p += record.length;
+	}
+
+	munmap(map, statbuf.st_size);
+
+	return index;
+
+damaged:
+	if (verbose)
+		fprintf(stderr, "Rebuilding damaged queue index\n");
+	queue_index_free(index);
+	munmap(map, statbuf.st_size);
+	return NULL;
+}
+
+/** Write out an index and rename it into place, with the old one locked */
+static void queue_index_replace(queue_index_t *index)
+{
+	queue_index_header_t header;
+	struct list_head *ptr;
+	char *path, *tmp, *buffer;
+	size_t size;
+	FILE *fp;
+	int fd;
+
+	path = queue_path(QUEUE_INDEX, "");
+	tmp = xmalloc(strlen(path) + 16);
+	sprintf(tmp, "%s.%d", path, (int)getpid());
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || !(fp = fdopen(fd, "w")))
+	{
+		if (verbose)
+			fprintf(stderr, "open: %s: %s\n", tmp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		goto done;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, QUEUE_INDEX_MAGIC, sizeof(QUEUE_INDEX_MAGIC));
+	header.version = QUEUE_INDEX_VERSION;
+	fwrite(&header, sizeof(header), 1, fp);
+
+	list_for_each(ptr, &index->list)
+	{
+		queue_index_entry_t *entry = list_entry(ptr, queue_index_entry_t, list);
+		queue_record_t record;
+
+		queue_record_init(&record, Record_ADD, entry->id);
+		record.ctime = entry->ctime;
+		record.next_try = entry->next_try;
+		record.attempts = entry->attempts;
+		record.size = entry->size;
+		record.priority = entry->priority;
+		record.nrecipients = entry->nrecipients;
+
+		buffer = queue_record_pack(&record, entry->sender, entry->recipients, &size);
+		fwrite(buffer, 1, size, fp);
+		free(buffer);
+	}
+
+	if (fclose(fp) || rename(tmp, path) < 0)
+		unlink(tmp);
+	else
+		index->records = index->count;
+
+done:
+	free(tmp);
+	free(path);
+}
+
+/** Rebuild the index from the envelopes, with the old one locked */
+static queue_index_t *queue_index_rebuild(void)
+{
+	queue_index_t *index;
+	char **ids, **p;
+
+	index = queue_index_new();
+
+	ids = queue_ids();
+	for (p = ids; *p; p++)
+	{
+		queue_entry_t entry;
+		queue_record_t record;
+		char **recipients, *buffer;
+		size_t size;
+		int i;
+
+		if (queue_entry_open(&entry, *p, 0) < 0)
+			continue;
+
+		recipients = (char **)xmalloc((entry.nrecipients + 1) * sizeof(char *));
+		for (i = 0; i < entry.nrecipients; i++)
+		{
+			const char *address = get_string(&entry.cursor);
+
+			recipients[i] = (char *)(address ? address : "");
+		}
+
+		queue_record_init(&record, Record_ADD, entry.id);
+		record.ctime = entry.header.ctime;
+		record.next_try = entry.header.next_try;
+		record.attempts = entry.header.attempts;
+		record.size = entry.header.size;
+		record.priority = entry.priority;
+		record.nrecipients = entry.nrecipients;
+
+		buffer = queue_record_pack(&record, entry.reverse_path, recipients, &size);
+		queue_index_apply(index, &record, buffer + sizeof(queue_record_t));
+
+		free(buffer);
+		free(recipients);
+		queue_entry_close(&entry);
+	}
+	queue_ids_free(ids);
+
+	queue_index_replace(index);
+
+	return index;
+}
+
+/** Append a record to the index */
+static void queue_index_log(queue_record_t *record, const char *sender, char * const *recipients)
+{
+	struct stat statbuf;
+	char *buffer;
+	size_t size;
+	int fd;
+
+	buffer = queue_record_pack(record, sender, recipients, &size);
+
+	fd = queue_index_open(LOCK_EX);
+
+	/* a new index is built from the envelopes, this record included */
+	if (fstat(fd, &statbuf) == 0 && statbuf.st_size == 0)
+		queue_index_free(queue_index_rebuild());
+	else if (write(fd, buffer, size) != (ssize_t)size)
+		fprintf(stderr, "%s: %s\n", QUEUE_INDEX, strerror(errno));
+
+	close(fd);
+	free(buffer);
+}
+
+/** Read the index, rebuilding it if needed */
+static queue_index_t *queue_index_load(void)
+{
+	queue_index_t *index;
+	int fd;
+
+	fd = queue_index_open(LOCK_SH);
+	index = queue_index_read(fd);
+	close(fd);
+
+	if (!index)
+	{
+		fd = queue_index_open(LOCK_EX);
+		if (!(index = queue_index_read(fd)))
+			index = queue_index_rebuild();
+		close(fd);
+	}
+
+	return index;
+}
+
+/**
+ * Rebuild the index if it's out of step with the envelopes, or compact it if
+ * it's mostly made of dead records.
+ */
+static queue_index_t *queue_index_sync(char **ids)
+{
+	queue_index_t *index;
+	char **p;
+	int fd, n = 0, stale = 0;
+
+	fd = queue_index_open(LOCK_EX);
+
+	if ((index = queue_index_read(fd)))
+	{
+		for (p = ids; *p && !stale; p++, n++)
+		{
+			queue_index_entry_t *entry = hash_lookup(index->entries, *p);
+
+			if (!entry || entry->removed)
+				stale = 1;
+		}
+
+		if (stale || n != index->count)
+		{
+			queue_index_free(index);
+			index = NULL;
+		}
+		else if (index->records > 2 * index->count + 64)
+			queue_index_replace(index);
+	}
+
+	if (!index)
+		index = queue_index_rebuild();
+
+	close(fd);
+
+	return index;
+}
+
+/*@}*/
+
+
+/**
+ * \name Selection
+ *
+ * Queue runs and listings can be restricted by the -q selectors, matched
+ * against the index.  Each lane makes a queue group, the normal one keeping
+ * sendmail's default name.
+ */
+/*@{*/
+
+/** Queue group of each lane */
+static const char * const queue_groups[QUEUE_LANES] = { "urgent", "mqueue", "bulk" };
+
+/** A -q selector */
+typedef struct {
+	struct list_head list;
+	int what;		/**< 'I', 'R', 'S' or 'G' */
+	int negate;
+	char *pattern;
+} queue_selector_t;
+
+static LIST_HEAD(queue_selectors);
+
+void queue_select(int what, int negate, const char *pattern)
+{
+	queue_selector_t *selector;
+
+	selector = (queue_selector_t *)xmalloc(sizeof(queue_selector_t));
+	selector->what = what;
+	selector->negate = negate;
+	selector->pattern = xstrdup(pattern);
+
+	list_add_tail(&selector->list, &queue_selectors);
+}
+
+/** Whether \p s contains \p pattern, optionally ignoring case */
+static int queue_contains(const char *s, const char *pattern, int fold)
+{
+	size_t len = strlen(pattern);
+
+	for (; *s; s++)
+		if (fold ? !strncasecmp(s, pattern, len) : !strncmp(s, pattern, len))
+			return 1;
+
+	return !len;
+}
+
+static int queue_selector_match(queue_selector_t *selector, queue_index_entry_t *entry)
+{
+	int match = 0, i;
+
+	switch (selector->what)
+	{
+		case 'I':
+			match = queue_contains(entry->id, selector->pattern, 0);
+			break;
+
+		case 'R':
+			for (i = 0; i < entry->nrecipients && !match; i++)
+				match = queue_contains(entry->recipients[i], selector->pattern, 1);
+			break;
+
+		case 'S':
+			match = queue_contains(entry->sender, selector->pattern, 1);
+			break;
+
+		case 'G':
+			match = !strcmp(queue_groups[QUEUE_LANE(entry->priority)], selector->pattern);
+			break;
+	}
+
+	return match != selector->negate;
+}
+
+/**
+ * Whether a queued message is selected: selectors of the same kind are
+ * alternatives, while all kinds must match.
+ */
+static int queue_selected(queue_index_entry_t *entry)
+{
+	struct list_head *ptr;
+	const char *what;
+
+	for (what = "IRSG"; *what; what++)
+	{
+		int given = 0, match = 0;
+
+		list_for_each(ptr, &queue_selectors)
+		{
+			queue_selector_t *selector = list_entry(ptr, queue_selector_t, list);
+
+			if (selector->what != *what)
+				continue;
+
+			given = 1;
+			if (queue_selector_match(selector, entry))
+			{
+				match = 1;
+				break;
+			}
+		}
+
+		if (given && !match)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*@}*/
+
+
+/**
+ * \name Queueing
+ */
+/*@{*/
+
+static void put_int(FILE *fp, int value)
+{
+	fwrite(&value, sizeof(value), 1, fp);
+}
+
+/** Strings are stored as their length plus one (zero for NULL) and the bytes */
+static void put_string(FILE *fp, const char *s)
+{
+	if (!s)
+		put_int(fp, 0);
+	else
+	{
+		int len = strlen(s);
+
+		put_int(fp, len + 1);
+		fwrite(s, 1, len + 1, fp);
+	}
+}
+
+/** Gather the recipients, oldest first so that adding them back restores the order */
+static int get_recipients(char **addresses, int n, struct list_head *recipients)
+{
+	struct list_head *ptr;
+
+	list_for_each_prev(ptr, recipients)
+		addresses[n++] = list_entry(ptr, recipient_t, list)->address;
+
+	return n;
+}
+
+void queue_spool(message_t *message)
+{
+	static unsigned sequence = 0;
+	char name[32], *dir;
+	int shard;
+
+	/* spread over the shards by process, and by message within one, with a
+	 * multiplicative hash as process ids often go up in even steps */
+	shard = (((unsigned)getpid() + sequence++) * 2654435761U >> 16) % QUEUE_SHARDS;
+	dir = queue_shard_directory(shard);
+
+	/* the id is the time and the shard followed by mkstemp()'s unique suffix */
+	sprintf(name, "df%08lX%XXXXXXX", (unsigned long)time(NULL), shard);
+
+	assert(!message->spool_path);
+	message_spool_in(message, dir, name);
+
+	free(dir);
+}
+
+char *queue_commit(message_t *message)
+{
+	queue_header_t header;
+	queue_record_t record;
+	struct list_head *ptr;
+	char *id, **recipients, *envelope;
+	size_t length;
+	FILE *fp;
+	int n, i;
+
+	assert(message->spool_path && message->spool_crlf);
+	id = xstrdup(strrchr(message->spool_path, '/') + 3);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, QUEUE_MAGIC, sizeof(QUEUE_MAGIC));
+	header.version = QUEUE_VERSION;
+	header.ctime = time(NULL);
+	header.size = message->size;
+	header.longest_line = message->longest_line;
+	header.eightbit = message->eightbit;
+	header.body = message->body;
+	header.ret = message->ret;
+	header.notify = message->notify;
+
+	if (!(fp = open_memstream(&envelope, &length)))
+	{
+		perror("open_memstream");
+		exit(EX_OSERR);
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+	put_string(fp, message->reverse_path);
+	put_string(fp, message->envid);
+
+	n = 0;
+	list_for_each(ptr, &message->remote_recipients)
+		n++;
+	list_for_each(ptr, &message->local_recipients)
+		n++;
+	recipients = (char **)xmalloc((n + 1) * sizeof(char *));
+	n = get_recipients(recipients, 0, &message->remote_recipients);
+	n = get_recipients(recipients, n, &message->local_recipients);
+
+	put_int(fp, n);
+	for (i = 0; i < n; i++)
+		put_string(fp, recipients[i]);
+
+	if (message->priority == Priority_NOTSET)
+		message->priority = Priority_NORMAL;
+	put_int(fp, message->priority);
+
+	if (fclose(fp))
+	{
+		perror("open_memstream");
+		exit(EX_OSERR);
+	}
+
+	/* Small messages are synced along with others, large ones on their own */
+	if (message->size <= QUEUE_JOURNAL_LARGE)
+		queue_journal_commit(id, envelope, length, message->fp);
+	else
+	{
+		if (fsync(fileno(message->fp)) < 0)
+		{
+			perror(message->spool_path);
+			exit(EX_IOERR);
+		}
+		queue_write_envelope(id, envelope, length, 1);
+	}
+	free(envelope);
+
+	/* the data file belongs to the queue from now on */
+	message->spool_keep = 1;
+
+	queue_record_init(&record, Record_ADD, id);
+	record.ctime = header.ctime;
+	record.size = header.size;
+	record.priority = message->priority;
+	record.nrecipients = n;
+	queue_index_log(&record, message->reverse_path, recipients);
+	free(recipients);
+
+	if (verbose)
+		fprintf(stdout, "Queued as %s\n", id);
+
+	return id;
+}
+
+/*@}*/
+
+
+/**
+ * \name Retries
+ *
+ * Messages which fail temporarily are retried with an exponential backoff,
+ * until they fail permanently or expire, and are then returned to their
+ * sender.
+ */
+/*@{*/
+
+#define QUEUE_BACKOFF		60			/**< first delay, in seconds */
+#define QUEUE_BACKOFF_MAX	(4 * 60 * 60)		/**< longest delay, absent an interval */
+#define QUEUE_LIFETIME		(5 * 24 * 60 * 60)	/**< default lifetime, in seconds */
+
+int queue_interval = 0;
+int queue_lifetime = QUEUE_LIFETIME;
+
+/**
+ * Delay before the next attempt after \p failures in a row, doubling from
+ * #QUEUE_BACKOFF up to the queue interval.  Half of it is random, so that the
+ * messages which failed together, e.g., when a relay restarted, don't all
+ * come back at once.
+ */
+static time_t queue_backoff(int failures)
+{
+	time_t delay = QUEUE_BACKOFF, limit = queue_interval ? queue_interval : QUEUE_BACKOFF_MAX;
+
+	while (--failures > 0 && delay < limit)
+		delay *= 2;
+	if (delay > limit)
+		delay = limit;
+
+	return delay - random() % (delay / 2 + 1);
+}
+
+/** Whether a status isn't worth retrying */
+static int queue_permanent(int status)
+{
+	switch (status)
+	{
+		case EX_DATAERR:
+		case EX_NOUSER:
+		case EX_NOHOST:
+		case EX_UNAVAILABLE:
+		case EX_NOPERM:
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
+/*
+ * The hosts which couldn't be reached are deferred as a whole, with the same
+ * backoff as the messages, rather than trying each of their messages in turn.
+ * They are kept in the queue directory, for the next runs.
+ */
+
+#define QUEUE_HOSTS	"hosts"
+
+typedef struct {
+	char host[QUEUE_HOST_SIZE];
+	int failures;		/**< failures in a row */
+	time_t until;		/**< when to try it again */
+} queue_host_t;
+
+static queue_host_t *queue_hosts = NULL;
+static int queue_nhosts = 0;
+
+static void queue_hosts_load(void)
+{
+	char *path = queue_path(QUEUE_HOSTS, "");
+	struct stat statbuf;
+	int fd;
+
+	free(queue_hosts);
+	queue_hosts = NULL;
+	queue_nhosts = 0;
+
+	if ((fd = open(path, O_RDONLY)) >= 0)
+	{
+		if (fstat(fd, &statbuf) == 0 && statbuf.st_size % sizeof(queue_host_t) == 0)
+		{
+			queue_hosts = xmalloc(statbuf.st_size + sizeof(queue_host_t));
+			if (read(fd, queue_hosts, statbuf.st_size) == statbuf.st_size)
+				queue_nhosts = statbuf.st_size / sizeof(queue_host_t);
+		}
+		close(fd);
+	}
+
+	free(path);
+}
+
+/** Save the hosts still failing, best effort as they are just a hint */
+static void queue_hosts_save(void)
+{
+	char *path, *tmp, pid[16];
+	int fd, i;
+
+	sprintf(pid, "%d", (int)getpid());
+	path = queue_path(QUEUE_HOSTS, "");
+	tmp = queue_path(QUEUE_HOSTS ".", pid);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600)) >= 0)
+	{
+		int ok = 1;
+
+		for (i = 0; i < queue_nhosts && ok; i++)
+			if (queue_hosts[i].failures)
+				ok = write(fd, &queue_hosts[i], sizeof(queue_host_t)) == sizeof(queue_host_t);
+
+		if (close(fd) < 0 || !ok || rename(tmp, path) < 0)
+			unlink(tmp);
+	}
+
+	free(tmp);
+	free(path);
+}
+
+static queue_host_t *queue_host_find(const char *host, int create)
+{
+	int i;
+
+	for (i = 0; i < queue_nhosts; i++)
+		if (!strcmp(queue_hosts[i].host, host))
+			return &queue_hosts[i];
+
+	if (!create)
+		return NULL;
+
+	queue_hosts = xrealloc(queue_hosts, (queue_nhosts + 1) * sizeof(queue_host_t));
+	memset(&queue_hosts[queue_nhosts], 0, sizeof(queue_host_t));
+	strcpy(queue_hosts[queue_nhosts].host, host);
+
+	return &queue_hosts[queue_nhosts++];
+}
+
+int queue_host_deferred(const char *host)
+{
+	queue_host_t *h = queue_host_find(host, 0);
+
+	return h && h->until > time(NULL);
+}
+
+/**
+ * Account for the hosts in the outcome of a batch.
+ *
+ * \return nonzero if any changed.
+ */
+static int queue_hosts_update(const queue_status_t *statuses, int n, time_t now)
+{
+	queue_host_t *h;
+	int i, changed = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if (!statuses[i].host[0])
+			continue;
+
+		if (statuses[i].unreachable)
+		{
+			/* once per batch, as all its messages failed together */
+			h = queue_host_find(statuses[i].host, 1);
+			if (h->until > now)
+				continue;
+			h->until = now + queue_backoff(++h->failures);
+			changed = 1;
+			fprintf(stderr, "%s: unreachable, deferred for %ld seconds\n",
+				h->host, (long)(h->until - now));
+		}
+		else if (statuses[i].status == EX_OK && (h = queue_host_find(statuses[i].host, 0)) && h->failures)
+		{
+			h->failures = 0;
+			h->until = 0;
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+/**
+ * Return a message to its sender, as a new queued message from the null
+ * reverse path, with the reason and the headers of the message.
+ */
+static void queue_bounce(queue_entry_t *entry, const char *reason)
+{
+	message_t *message;
+	cursor_t c = entry->cursor;
+	const char *sender = entry->reverse_path;
+	char host[256], date[64], line[1024], *id, *df;
+	time_t now = time(NULL);
+	FILE *fp, *in;
+	int i;
+
+	/* Never bounce a bounce, nor against NOTIFY */
+	if ((sender && !sender[0]) || entry->header.notify == Notify_NEVER ||
+	    (entry->header.notify != Notify_NOTSET && !(entry->header.notify & Notify_FAILURE)))
+	{
+		fprintf(stderr, "%s: %s, dropped\n", entry->id, reason);
+		return;
+	}
+
+	/* Without a reverse path it came from the local user */
+	if (!sender)
+	{
+		struct passwd *pw;
+
+		if (!(pw = getpwuid(getuid())))
+		{
+			fprintf(stderr, "%s: %s, dropped as the sender is unknown\n", entry->id, reason);
+			return;
+		}
+		sender = pw->pw_name;
+	}
+
+	if (gethostname(host, sizeof(host)))
+		strcpy(host, "localhost");
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", localtime(&now));
+
+	if (!(fp = tmpfile()))
+	{
+		perror("tmpfile");
+		exit(EX_CANTCREAT);
+	}
+
+	fprintf(fp, "From: Mail Delivery System <MAILER-DAEMON@%s>\n", host);
+	fprintf(fp, "To: %s\n", sender);
+	fprintf(fp, "Subject: Undelivered Mail Returned to Sender\n");
+	fprintf(fp, "Date: %s\n", date);
+	fprintf(fp, "Auto-Submitted: auto-replied\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "This is the mail system at host %s.\n\n", host);
+	fprintf(fp, "Your message %s could not be delivered to the following\n", entry->id);
+	fprintf(fp, "recipients, after %d attempts: %s.\n\n", entry->header.attempts + 1, reason);
+	for (i = 0; i < entry->nrecipients; i++)
+		fprintf(fp, "\t%s\n", get_string(&c));
+	fprintf(fp, "\n------ Headers of the returned message ------\n\n");
+
+	df = queue_path("df", entry->id);
+	if ((in = fopen(df, "r")))
+	{
+		while (fgets(line, sizeof(line), in) && strcmp(line, "\r\n"))
+			fputs(line, fp);
+		fclose(in);
+	}
+	free(df);
+
+	if (fflush(fp) || ferror(fp))
+	{
+		perror("tmpfile");
+		exit(EX_IOERR);
+	}
+	rewind(fp);
+
+	message = message_new();
+	message->fp = fp;
+	message_set_reverse_path(message, "");
+	message_add_recipient(message, sender);
+
+	queue_spool(message);
+	id = queue_commit(message);
+	fprintf(stderr, "%s: %s, returned to %s as %s\n", entry->id, reason, sender, id);
+
+	free(id);
+	message_free(message);
+}
+
+/**
+ * Account for a delivery attempt.
+ *
+ * \return zero if the message is no longer queued.
+ */
+static int queue_entry_done(queue_entry_t *entry, const queue_status_t *status, time_t now)
+{
+	queue_record_t record;
+	queue_host_t *host;
+
+	if (status->status != EX_OK && queue_permanent(status->status))
+		queue_bounce(entry, "delivery failed permanently");
+	else if (status->status != EX_OK && now - entry->header.ctime >= queue_lifetime)
+		queue_bounce(entry, "message expired in the queue");
+	else if (status->status != EX_OK)
+	{
+		if (status->retry)
+			/* Not tried, held back */
+			entry->header.next_try = status->retry;
+		else if (status->host[0] && !status->unreachable &&
+		    (host = queue_host_find(status->host, 0)) && host->until > now)
+			/* Not tried, waiting for its host */
+			entry->header.next_try = host->until;
+		else
+		{
+			entry->header.attempts++;
+			entry->header.next_try = now + queue_backoff(entry->header.attempts);
+		}
+		queue_entry_update(entry);
+
+		queue_record_init(&record, Record_UPDATE, entry->id);
+		record.attempts = entry->header.attempts;
+		record.next_try = entry->header.next_try;
+		queue_index_log(&record, NULL, NULL);
+
+		if (verbose)
+			fprintf(stderr, "%s: delivery deferred, kept in queue\n", entry->id);
+
+		return 1;
+	}
+
+	queue_entry_remove(entry);
+	queue_record_init(&record, Record_REMOVE, entry->id);
+	queue_index_log(&record, NULL, NULL);
+
+	return 0;
+}
+
+/*@}*/
+
+
+/**
+ * \name Delivery
+ *
+ * Messages wait in a lane according to their priority, and the lanes with
+ * messages due take turns to deliver a batch, so that urgent messages get
+ * through however much bulk mail is queued.
+ */
+/*@{*/
+
+#define QUEUE_BATCH	100	/**< most messages delivered at once */
+#define QUEUE_BUSY	5	/**< delay before looking again at a message being delivered, in seconds */
+
+/** Batches each lane delivers per round, most urgent first */
+static const int queue_lane_weights[QUEUE_LANES] = { 4, 2, 1 };
+
+/**
+ * Pick the lane to deliver a batch from, by smooth weighted round robin, so
+ * that the turns of each lane are spread over the round.  The lanes with
+ * nothing due lose their turns to the others.
+ *
+ * \param credits of the lanes, starting as zero and kept between calls.
+ * \param due whether each lane has messages due.
+ *
+ * \return -1 if no lane has messages due.
+ */
+static int queue_lane_pick(int *credits, const int *due)
+{
+	int lane, best = -1, total = 0;
+
+	for (lane = 0; lane < QUEUE_LANES; lane++)
+	{
+		if (!due[lane])
+		{
+			credits[lane] = 0;
+			continue;
+		}
+
+		credits[lane] += queue_lane_weights[lane];
+		total += queue_lane_weights[lane];
+		if (best < 0 || credits[lane] > credits[best])
+			best = lane;
+	}
+
+	if (best >= 0)
+		credits[best] -= total;
+
+	return best;
+}
+
+/** Retry timers of the persistent runs, in a binary min-heap */
+typedef struct {
+	struct {
+		time_t when;
+		char id[QUEUE_ID_SIZE];
+	} *timers;
+	int count, size;
+} queue_heap_t;
+
+static void queue_heap_push(queue_heap_t *heap, time_t when, const char *id)
+{
+	int i, parent;
+
+	if (heap->count == heap->size)
+	{
+		heap->size = heap->size ? 2 * heap->size : 64;
+		heap->timers = xrealloc(heap->timers, heap->size * sizeof(*heap->timers));
+	}
+
+	/* sift up */
+	for (i = heap->count++; i > 0; i = parent)
+	{
+		parent = (i - 1) / 2;
+		if (heap->timers[parent].when <= when)
+			break;
+		heap->timers[i] = heap->timers[parent];
+	}
+	heap->timers[i].when = when;
+	assert(strlen(id) < QUEUE_ID_SIZE);
+	strcpy(heap->timers[i].id, id);
+}
+
+/** Pop the earliest timer into \p id */
+static void queue_heap_pop(queue_heap_t *heap, char *id)
+{
+	int i, child;
+
+	assert(heap->count);
+	strcpy(id, heap->timers[0].id);
+
+	/* sift the last one down from the top */
+	heap->count--;
+	for (i = 0; (child = 2 * i + 1) < heap->count; i = child)
+	{
+		if (child + 1 < heap->count && heap->timers[child + 1].when < heap->timers[child].when)
+			child++;
+		if (heap->timers[heap->count].when <= heap->timers[child].when)
+			break;
+		heap->timers[i] = heap->timers[child];
+	}
+	heap->timers[i] = heap->timers[heap->count];
+}
+
+/** The batch delivered by this process, as the child of a run */
+static struct {
+	int fd;			/**< to report the outcomes, -1 once they are */
+	queue_entry_t *entries;
+	queue_status_t *statuses;
+	int n;
+} queue_batch = { -1, NULL, NULL, 0 };
+
+/** Report the outcome of the batch to the run, if not done yet */
+static void queue_batch_report(void)
+{
+	size_t done;
+	ssize_t count;
+
+	if (queue_batch.fd < 0)
+		return;
+
+	for (done = 0; done < queue_batch.n * sizeof(queue_status_t); done += count)
+		if ((count = write(queue_batch.fd, (char *)queue_batch.statuses + done,
+		                   queue_batch.n * sizeof(queue_status_t) - done)) <= 0)
+			break;
+
+	close(queue_batch.fd);
+	queue_batch.fd = -1;
+}
+
+/**
+ * Deliver a batch of queued messages, in a child process, which gets a chance
+ * to deliver them in a single session.
+ *
+ * \param heaps if given, where to schedule the retries, by lane.
+ *
+ * \return the number of messages left in the queue.
+ */
+static int queue_deliver_batch(char **ids, int n, queue_deliver_t deliver, queue_heap_t *heaps)
+{
+	queue_entry_t *entries;
+	queue_status_t *statuses;
+	int fds[2], i, k = 0, queued = 0, ret;
+	size_t done;
+	ssize_t count;
+	time_t now = time(NULL);
+	pid_t pid;
+
+	/* Lock the messages due, skipping those being delivered by others */
+	entries = (queue_entry_t *)xmalloc(n * sizeof(queue_entry_t));
+	for (i = 0; i < n; i++)
+	{
+		if ((ret = queue_entry_open(&entries[k], ids[i], 1)) != 0)
+		{
+			/* Look again later, as a lingering session may not take it */
+			if (ret > 0 && heaps && queue_entry_open(&entries[k], ids[i], 0) == 0)
+			{
+				queue_heap_push(&heaps[QUEUE_LANE(entries[k].priority)], now + QUEUE_BUSY, ids[i]);
+				queue_entry_close(&entries[k]);
+			}
+			continue;
+		}
+
+		if (entries[k].header.next_try > now)
+		{
+			if (heaps)
+				queue_heap_push(&heaps[QUEUE_LANE(entries[k].priority)],
+				                entries[k].header.next_try, entries[k].id);
+			queue_entry_close(&entries[k]);
+			queued++;
+			continue;
+		}
+
+		if (verbose)
+			fprintf(stdout, "Delivering %s\n", ids[i]);
+		k++;
+	}
+
+	if (!k)
+	{
+		free(entries);
+		return queued;
+	}
+
+	/* As other runs may have found hosts down meanwhile */
+	queue_hosts_load();
+
+	/* Unless the child tells otherwise */
+	statuses = (queue_status_t *)xmalloc(k * sizeof(queue_status_t));
+	memset(statuses, 0, k * sizeof(queue_status_t));
+	for (i = 0; i < k; i++)
+		statuses[i].status = EX_SOFTWARE;
+
+	if (pipe(fds) < 0)
+	{
+		perror("pipe");
+		exit(EX_OSERR);
+	}
+
+	fflush(NULL);
+	if ((pid = fork()) < 0)
+	{
+		perror("fork");
+		exit(EX_OSERR);
+	}
+
+	if (pid == 0)
+	{
+		message_t **messages;
+
+		close(fds[0]);
+
+		messages = (message_t **)xmalloc(k * sizeof(message_t *));
+		for (i = 0; i < k; i++)
+			messages[i] = queue_entry_message(&entries[i]);
+
+		queue_batch.fd = fds[1];
+		queue_batch.entries = entries;
+		queue_batch.statuses = statuses;
+		queue_batch.n = k;
+
+		deliver(messages, k, statuses);
+
+		/* unless a lingering session reported them already */
+		queue_batch_report();
+
+		for (i = 0; i < k; i++)
+			message_free(messages[i]);
+		exit(EX_OK);
+	}
+
+	close(fds[1]);
+	for (done = 0; done < k * sizeof(queue_status_t); done += count)
+		if ((count = read(fds[0], (char *)statuses + done, k * sizeof(queue_status_t) - done)) <= 0)
+			break;
+	close(fds[0]);
+
+	/* A child lingering on its session is reaped by the persistent run */
+	while (waitpid(pid, NULL, heaps ? WNOHANG : 0) < 0)
+		if (errno != EINTR)
+		{
+			perror("waitpid");
+			exit(EX_OSERR);
+		}
+
+	/* Against the hosts as they were, to tell the messages left waiting */
+	now = time(NULL);
+	for (i = 0; i < k; i++)
+	{
+		if (queue_entry_done(&entries[i], &statuses[i], now))
+		{
+			if (heaps)
+				queue_heap_push(&heaps[QUEUE_LANE(entries[i].priority)],
+				                entries[i].header.next_try, entries[i].id);
+			queued++;
+		}
+		queue_entry_close(&entries[i]);
+	}
+
+	if (queue_hosts_update(statuses, k, now))
+		queue_hosts_save();
+
+	free(statuses);
+	free(entries);
+
+	return queued;
+}
+
+/**
+ * Deliver the messages of a shard in batches, the lanes taking turns.
+ *
+ * \param start where each lane of the shard starts in \p ids, and ends, as
+ * the next one starts.
+ */
+static int queue_run_shard(char **ids, const int *start, queue_deliver_t deliver)
+{
+	int next[QUEUE_LANES], due[QUEUE_LANES], credits[QUEUE_LANES];
+	int queued = 0, lane, n;
+
+	for (lane = 0; lane < QUEUE_LANES; lane++)
+	{
+		next[lane] = start[lane];
+		credits[lane] = 0;
+	}
+
+	for (;;)
+	{
+		for (lane = 0; lane < QUEUE_LANES; lane++)
+			due[lane] = next[lane] < start[lane + 1];
+		if ((lane = queue_lane_pick(credits, due)) < 0)
+			break;
+
+		n = start[lane + 1] - next[lane];
+		if (n > QUEUE_BATCH)
+			n = QUEUE_BATCH;
+		queued += queue_deliver_batch(ids + next[lane], n, deliver, NULL);
+		next[lane] += n;
+	}
+
+	return queued;
+}
+
+/** Where a message sorts for a run, by shard, then by lane */
+static int queue_bucket(const char *id, const queue_index_entry_t *entry)
+{
+	int shard = queue_shard(id);
+
+	/* the index may not know of it yet */
+	return (shard < 0 ? QUEUE_SHARDS : shard) * QUEUE_LANES +
+		QUEUE_LANE(entry ? entry->priority : Priority_NORMAL);
+}
+
+int queue_run(queue_deliver_t deliver)
+{
+	queue_index_t *index;
+	char **ids, **p, **selected;
+	int start[(QUEUE_SHARDS + 1) * QUEUE_LANES + 1], next[(QUEUE_SHARDS + 1) * QUEUE_LANES];
+	pid_t pids[QUEUE_SHARDS + 1];
+	int queued = 0, workers = 0, fds[2], count, i;
+
+	srandom(time(NULL) ^ getpid());
+	queue_journal_checkpoint();
+
+	ids = queue_ids();
+	index = queue_index_sync(ids);
+
+	/* Sort the selected messages by shard, with those outside of the shards
+	 * last, and by lane, keeping their order */
+	memset(start, 0, sizeof(start));
+	for (p = ids; *p; p++)
+		;
+	selected = (char **)xmalloc((p - ids + 1) * sizeof(char *));
+
+	for (p = ids; *p; p++)
+	{
+		queue_index_entry_t *entry = hash_lookup(index->entries, *p);
+
+		if (entry && !queue_selected(entry))
+			continue;
+
+		start[queue_bucket(*p, entry) + 1]++;
+	}
+	for (i = 0; i < (QUEUE_SHARDS + 1) * QUEUE_LANES; i++)
+	{
+		start[i + 1] += start[i];
+		next[i] = start[i];
+	}
+	for (i = 0; i <= QUEUE_SHARDS; i++)
+		if (start[(i + 1) * QUEUE_LANES] > start[i * QUEUE_LANES])
+			workers++;
+	for (p = ids; *p; p++)
+	{
+		queue_index_entry_t *entry = hash_lookup(index->entries, *p);
+
+		if (entry && !queue_selected(entry))
+			continue;
+
+		selected[next[queue_bucket(*p, entry)]++] = *p;
+	}
+
+	queue_index_free(index);
+
+	if (workers <= 1)
+		for (i = 0; i <= QUEUE_SHARDS; i++)
+			queued += queue_run_shard(selected, start + i * QUEUE_LANES, deliver);
+	else
+	{
+		/* One worker per shard, telling how many messages it left */
+		if (pipe(fds) < 0)
+		{
+			perror("pipe");
+			exit(EX_OSERR);
+		}
+
+		fflush(NULL);
+		for (i = 0; i <= QUEUE_SHARDS; i++)
+		{
+			pids[i] = 0;
+			if (start[(i + 1) * QUEUE_LANES] == start[i * QUEUE_LANES])
+				continue;
+
+			if ((pids[i] = fork()) < 0)
+			{
+				perror("fork");
+				exit(EX_OSERR);
+			}
+
+			if (pids[i] == 0)
+			{
+				close(fds[0]);
+				srandom(time(NULL) ^ getpid());
+
+				count = queue_run_shard(selected, start + i * QUEUE_LANES, deliver);
+				if (write(fds[1], &count, sizeof(count)) != sizeof(count))
+					exit(EX_IOERR);
+				exit(EX_OK);
+			}
+		}
+
+		close(fds[1]);
+		while (read(fds[0], &count, sizeof(count)) == sizeof(count))
+			queued += count;
+		close(fds[0]);
+
+		for (i = 0; i <= QUEUE_SHARDS; i++)
+			if (pids[i])
+				while (waitpid(pids[i], NULL, 0) < 0)
+					if (errno != EINTR)
+					{
+						perror("waitpid");
+						exit(EX_OSERR);
+					}
+	}
+
+	free(selected);
+	queue_ids_free(ids);
+
+	return queued;
+}
+
+int queue_deliver(char **ids, int n, queue_deliver_t deliver)
+{
+	int queued = 0, i, k;
+
+	srandom(time(NULL) ^ getpid());
+
+	for (i = 0; i < n; i += k)
+	{
+		k = n - i < QUEUE_BATCH ? n - i : QUEUE_BATCH;
+		queued += queue_deliver_batch(ids + i, k, deliver, NULL);
+	}
+
+	return queued;
+}
+
+int queue_parse_interval(const char *s)
+{
+	int interval = 0, unit;
+	long value;
+	char *end;
+
+	do {
+		value = strtol(s, &end, 10);
+		if (end == s || value < 0)
+			return -1;
+
+		unit = 1;
+		switch (*end)
+		{
+			case 'w': unit *= 7;
+				/* fall through */
+			case 'd': unit *= 24;
+				/* fall through */
+			case 'h': unit *= 60;
+				/* fall through */
+			case 'm': case '\0': unit *= 60;
+			case 's': break;
+			default: return -1;
+		}
+
+		/* e.g. -q5000w */
+		if (value > (INT_MAX - interval) / unit)
+			return -1;
+
+		interval += value * unit;
+		s = *end ? end + 1 : end;
+	} while (*s);
+
+	return interval;
+}
+
+/*@}*/
+
+
+/**
+ * \name Persistent runs
+ *
+ * Queued messages are noticed as soon as their envelope is renamed into the
+ * queue directory, thanks to inotify, and delivered after a short while
+ * gathering the rest of a burst, so that they share a session.  Retries are
+ * scheduled from a heap of timers per lane, and the whole queue is only looked
+ * at again at each interval.  New messages are looked for between batches, so
+ * that an urgent one waits for one batch at most.
+ *
+ * The children delivering the batches may linger on their session, once
+ * they have reported the outcome of their batch, to deliver the messages
+ * queued meanwhile for the same relay without reconnecting.  They watch the
+ * queue themselves, racing with the run for the lock of each new message.
+ */
+/*@{*/
+
+#define QUEUE_INTERVAL	(30 * 60)	/**< default interval, in seconds */
+#define QUEUE_COALESCE	200		/**< time to gather a burst, in ms */
+#define QUEUE_RESCAN	5		/**< rescan period without inotify, in seconds */
+
+/** Schedule all the selected messages afresh, in the heap of their lane */
+static void queue_heap_load(queue_heap_t *heaps)
+{
+	queue_index_t *index;
+	struct list_head *ptr;
+	char **ids;
+	int i;
+
+	ids = queue_ids();
+	index = queue_index_sync(ids);
+	queue_ids_free(ids);
+
+	for (i = 0; i < QUEUE_LANES; i++)
+		heaps[i].count = 0;
+	list_for_each(ptr, &index->list)
+	{
+		queue_index_entry_t *entry = list_entry(ptr, queue_index_entry_t, list);
+
+		if (queue_selected(entry))
+			queue_heap_push(&heaps[QUEUE_LANE(entry->priority)], entry->next_try, entry->id);
+	}
+
+	queue_index_free(index);
+}
+
+/** Milliseconds on a monotonic clock */
+static long queue_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/**
+ * Schedule the messages just queued.
+ *
+ * \return nonzero if the heap had to be reloaded instead.
+ */
+static int queue_notified(int fd, queue_heap_t *heaps)
+{
+	union {
+		struct inotify_event event;
+		char buffer[4096];
+	} u;
+	queue_entry_t entry;
+	const char *p;
+	ssize_t n;
+
+	if ((n = read(fd, &u, sizeof(u))) <= 0)
+		return 0;
+
+	for (p = u.buffer; p < u.buffer + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+	{
+		const struct inotify_event *event = (const struct inotify_event *)p;
+
+		/* Events were lost, or the selectors need the index */
+		if (event->mask & IN_Q_OVERFLOW || !list_empty(&queue_selectors))
+		{
+			queue_heap_load(heaps);
+			return 1;
+		}
+
+		/* Its envelope tells its lane */
+		if (event->len && !strncmp(event->name, "qf", 2) && strlen(event->name + 2) < QUEUE_ID_SIZE &&
+		    queue_entry_open(&entry, event->name + 2, 0) == 0)
+		{
+			queue_heap_push(&heaps[QUEUE_LANE(entry.priority)], 0, entry.id);
+			queue_entry_close(&entry);
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/** Whether this is a persistent run, or one of its children */
+static int queue_persistent = 0;
+
+/** Messages taken by a lingering session, until their outcome is known */
+static struct {
+	message_t *message;
+	queue_entry_t entry;
+} *queue_lingered = NULL;
+static int queue_nlingered = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+/** Take one of the \p slots lingering slots of \p key, held until exiting */
+static int queue_linger_slot(const char *key, int slots)
+{
+	char name[32], *path;
+	int i, fd;
+
+	for (i = 0; i < slots; i++)
+	{
+		sprintf(name, "session.%08X.%d", queue_checksum(key, strlen(key)), i);
+		path = queue_path(name, "");
+		fd = open(path, O_RDWR | O_CREAT, 0600);
+		free(path);
+		if (fd < 0)
+			return 0;
+
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+			return 1;
+		close(fd);
+	}
+
+	return 0;
+}
+#endif
+
+message_t *queue_linger(const char *key, int slots, int timeout,
+                        int (*accept)(message_t *message, void *arg), void *arg)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	static int fd = -1;
+	union {
+		struct inotify_event event;
+		char buffer[4096];
+	} u;
+	queue_entry_t entry;
+	message_t *message;
+	const char *p;
+	long deadline, left;
+	struct pollfd pfd;
+	ssize_t n;
+	int i;
+
+	/* Selected runs would need the index */
+	if (!queue_persistent || !list_empty(&queue_selectors) || slots <= 0 || timeout <= 0)
+		return NULL;
+
+	if (fd < 0)
+	{
+		if (!queue_linger_slot(key, slots) || (fd = inotify_init()) < 0)
+			return NULL;
+
+		for (i = 0; i < QUEUE_SHARDS; i++)
+		{
+			char *path = queue_shard_directory(i);
+
+			inotify_add_watch(fd, path, IN_MOVED_TO | IN_ONLYDIR);
+			free(path);
+		}
+
+		/* Leave the batch to the run, lock and all */
+		queue_batch_report();
+		for (i = 0; i < queue_batch.n; i++)
+			close(queue_batch.entries[i].fd);
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	deadline = queue_clock() + timeout * 1000L;
+	while ((left = deadline - queue_clock()) > 0)
+	{
+		if (poll(&pfd, 1, left) <= 0 || (n = read(fd, &u, sizeof(u))) <= 0)
+			continue;
+
+		for (p = u.buffer; p < u.buffer + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+		{
+			const struct inotify_event *event = (const struct inotify_event *)p;
+
+			if (!event->len || strncmp(event->name, "qf", 2) || strlen(event->name + 2) >= QUEUE_ID_SIZE ||
+			    queue_entry_open(&entry, event->name + 2, 1) != 0)
+				continue;
+
+			if (entry.header.next_try <= time(NULL))
+			{
+				message = queue_entry_message(&entry);
+				if (accept(message, arg))
+				{
+					queue_lingered = xrealloc(queue_lingered, (queue_nlingered + 1) * sizeof(*queue_lingered));
+					queue_lingered[queue_nlingered].message = message;
+					queue_lingered[queue_nlingered].entry = entry;
+					queue_nlingered++;
+
+					if (verbose)
+						fprintf(stdout, "Delivering %s\n", entry.id);
+					return message;
+				}
+				message_free(message);
+			}
+
+			/* for the run to deliver */
+			queue_entry_close(&entry);
+		}
+	}
+#endif
+
+	return NULL;
+}
+
+void queue_linger_done(message_t *message, const queue_status_t *status)
+{
+	int i;
+
+	for (i = 0; i < queue_nlingered && queue_lingered[i].message != message; i++)
+		;
+	assert(i < queue_nlingered);
+
+	queue_entry_done(&queue_lingered[i].entry, status, time(NULL));
+	queue_entry_close(&queue_lingered[i].entry);
+	message_free(message);
+
+	queue_lingered[i] = queue_lingered[--queue_nlingered];
+}
+
+void queue_daemon(queue_deliver_t deliver)
+{
+	queue_heap_t heaps[QUEUE_LANES];
+	char *batch[QUEUE_BATCH];
+	struct pollfd pfd;
+	time_t now, reload;
+	int credits[QUEUE_LANES], due[QUEUE_LANES], lane, i, n;
+
+	if (!queue_interval)
+		queue_interval = QUEUE_INTERVAL;
+	queue_persistent = 1;
+
+	pfd.fd = -1;
+	pfd.events = POLLIN;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if ((pfd.fd = inotify_init()) >= 0)
+		for (i = 0; i < QUEUE_SHARDS; i++)
+		{
+			char *path = queue_shard_directory(i);
+
+			if (inotify_add_watch(pfd.fd, path, IN_MOVED_TO | IN_ONLYDIR) < 0)
+			{
+				close(pfd.fd);
+				pfd.fd = -1;
+				free(path);
+				break;
+			}
+			free(path);
+		}
+#endif
+	if (pfd.fd < 0 && verbose)
+		fprintf(stderr, "Can't watch the queue directory, polling it instead\n");
+
+	for (i = 0; i < QUEUE_BATCH; i++)
+		batch[i] = xmalloc(QUEUE_ID_SIZE);
+
+	memset(heaps, 0, sizeof(heaps));
+	memset(credits, 0, sizeof(credits));
+
+	srandom(time(NULL) ^ getpid());
+	queue_journal_checkpoint();
+
+	queue_heap_load(heaps);
+	reload = time(NULL) + queue_interval;
+
+	for (;;)
+	{
+		long timeout, deadline;
+
+		/* Sleep until the next retry, a new message or the next interval */
+		now = time(NULL);
+		if (reload <= now)
+		{
+			queue_heap_load(heaps);
+			reload = now + queue_interval;
+		}
+		if (pfd.fd < 0 && reload > now + QUEUE_RESCAN)
+			reload = now + QUEUE_RESCAN;
+
+		timeout = reload - now;
+		for (lane = 0; lane < QUEUE_LANES; lane++)
+			if (heaps[lane].count && heaps[lane].timers[0].when < now + timeout)
+				timeout = heaps[lane].timers[0].when > now ? heaps[lane].timers[0].when - now : 0;
+		if (timeout > 24 * 60 * 60)
+			timeout = 24 * 60 * 60;
+
+		if (poll(&pfd, pfd.fd >= 0, timeout * 1000) < 0 && errno != EINTR)
+		{
+			perror("poll");
+			exit(EX_OSERR);
+		}
+
+#ifdef HAVE_SYS_INOTIFY_H
+		/* Gather the rest of a burst */
+		if (pfd.fd >= 0 && pfd.revents & POLLIN)
+		{
+			deadline = queue_clock() + QUEUE_COALESCE;
+			while (!queue_notified(pfd.fd, heaps) &&
+			       (timeout = deadline - queue_clock()) > 0 &&
+			       poll(&pfd, 1, timeout) > 0)
+				;
+		}
+#endif
+
+		/* Deliver a batch from the lane whose turn it is, then look for new
+		 * messages again before the next one */
+		now = time(NULL);
+		for (lane = 0; lane < QUEUE_LANES; lane++)
+			due[lane] = heaps[lane].count && heaps[lane].timers[0].when <= now;
+		if ((lane = queue_lane_pick(credits, due)) >= 0)
+		{
+			for (n = 0; n < QUEUE_BATCH && heaps[lane].count && heaps[lane].timers[0].when <= now; n++)
+				queue_heap_pop(&heaps[lane], batch[n]);
+			queue_deliver_batch(batch, n, deliver, heaps);
+		}
+
+		queue_journal_check(QUEUE_JOURNAL_CHECKPOINT);
+
+		/* Children done lingering */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+	}
+}
+
+/*@}*/
+
+
+void queue_list(void)
+{
+	queue_index_t *index;
+	struct list_head *ptr;
+	int n = 0;
+
+	index = queue_index_load();
+
+	list_for_each(ptr, &index->list)
+	{
+		queue_index_entry_t *entry = list_entry(ptr, queue_index_entry_t, list);
+		char when[32];
+		int i;
+
+		if (!queue_selected(entry))
+			continue;
+
+		if (!n++)
+			printf("-----Q-ID----- --Size-- ----Q-Time----- ------------Sender/Recipient-----------\n");
+
+		strftime(when, sizeof(when), "%a %b %d %H:%M", localtime(&entry->ctime));
+		printf("%-14s %8lu %s %s\n", entry->id, entry->size, when,
+		       entry->sender[0] ? entry->sender : "<>");
+		if (entry->attempts)
+			printf("\t\t(%d delivery attempts)\n", entry->attempts);
+
+		for (i = 0; i < entry->nrecipients; i++)
+			printf("\t\t\t\t\t%s\n", entry->recipients[i]);
+	}
+
+	if (!n)
+		printf("Mail queue is empty\n");
+	else
+		printf("\t\tTotal requests: %d\n", n);
+
+	queue_index_free(index);
+}
+
+int queue_count(void)
+{
+	queue_index_t *index;
+	struct list_head *ptr;
+	int count = 0;
+
+	index = queue_index_load();
+	list_for_each(ptr, &index->list)
+		if (queue_selected(list_entry(ptr, queue_index_entry_t, list)))
+			count++;
+	queue_index_free(index);
+
+	return count;
+}
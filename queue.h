@@ -0,0 +1,146 @@
+/**
+ * \file queue.h
+ * Mail queue.
+ */
+
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+
+#include <time.h>
+
+#include "message.h"
+
+
+/** Queue directory, or NULL for ~/.esmtp_spool */
+extern char *queue_dir;
+
+/** The queue directory, created if needed */
+const char *queue_directory(void);
+
+/**
+ * Spool a message into the queue directory, as the first step of queueing
+ * it.
+ *
+ * The message is spooled with CRLF newlines and, if its headers were parsed,
+ * without its Bcc: header, so that delivering it later takes no more than
+ * reading it back.
+ */
+void queue_spool(message_t *message);
+
+/**
+ * Queue a message spooled by queue_spool(), by writing its envelope next to
+ * it.
+ *
+ * \return the queue id, to be freed by the caller.
+ */
+char *queue_commit(message_t *message);
+
+/**
+ * Restrict the queue runs and listings to the messages whose id, sender or
+ * one of whose recipients contains \p pattern, or whose queue group is
+ * \p pattern.  Addresses are matched ignoring case.
+ *
+ * Selectors of the same kind are alternatives, while all the kinds given must
+ * match.
+ *
+ * \param what one of 'I', 'R', 'S' or 'G', as with -q.
+ * \param negate whether to select the messages not matching instead.
+ */
+void queue_select(int what, int negate, const char *pattern);
+
+#define QUEUE_HOST_SIZE	128	/**< longest host name kept, plus one */
+
+/** Outcome of delivering a queued message */
+typedef struct {
+	/**
+	 * Sysexits status: EX_OK once delivered, EX_TEMPFAIL to retry it later,
+	 * or a permanent failure such as EX_UNAVAILABLE to return it to its
+	 * sender.
+	 */
+	int status;
+	int unreachable;		/**< whether \p host couldn't be reached */
+	char host[QUEUE_HOST_SIZE];	/**< host it was handed to, if known */
+	time_t retry;			/**< when to retry it, if held back without trying */
+} queue_status_t;
+
+/**
+ * Delivers a batch of queued messages, setting the outcome of each in
+ * \p statuses, which start as EX_SOFTWARE with no host.  Those not delivered
+ * are kept in the queue and retried with an exponential backoff, unless they
+ * failed permanently or were held back until a given retry time.
+ *
+ * Messages for a host which is deferred, according to queue_host_deferred(),
+ * should be reported as EX_TEMPFAIL for that host without trying it.
+ *
+ * It's called in a child process, so it may exit, in which case none of the
+ * messages is considered delivered.
+ */
+typedef void (*queue_deliver_t)(message_t **messages, int n, queue_status_t *statuses);
+
+/**
+ * Whether deliveries to \p host are deferred, as it couldn't be reached
+ * lately.
+ */
+int queue_host_deferred(const char *host);
+
+/** Longest delay between retries of a failed message, in seconds */
+extern int queue_interval;
+
+/** Age after which messages still queued are returned, in seconds */
+extern int queue_lifetime;
+
+/**
+ * Parse a queue interval, such as "1h30m", in seconds, where a bare number
+ * means minutes.
+ *
+ * \return -1 if it's invalid.
+ */
+int queue_parse_interval(const char *s);
+
+/**
+ * Deliver the queued messages which are due, in batches.
+ *
+ * \return the number of messages left in the queue after failing delivery.
+ */
+int queue_run(queue_deliver_t deliver);
+
+/**
+ * Deliver queued messages right away, in batches, skipping those a queue run
+ * already is delivering.
+ *
+ * \return the number of messages left in the queue after failing delivery.
+ */
+int queue_deliver(char **ids, int n, queue_deliver_t deliver);
+
+/**
+ * Wait up to \p timeout seconds for a message to be queued which \p accept
+ * takes, so as to deliver it in the session a batch was delivered in, from
+ * queue_deliver_t.  Once first called, the outcome of the batch is reported
+ * as it's set in the statuses by then, and the later ones are to be reported
+ * by queue_linger_done().
+ *
+ * It only lingers in persistent runs, in up to \p slots processes at once for
+ * the same \p key, e.g., the relay.
+ *
+ * \return NULL once there is no more.
+ */
+message_t *queue_linger(const char *key, int slots, int timeout,
+                        int (*accept)(message_t *message, void *arg), void *arg);
+
+/** Account for the delivery of a message taken by queue_linger(), and free it */
+void queue_linger_done(message_t *message, const queue_status_t *status);
+
+/**
+ * Keep delivering the queued messages, as they are queued and as their
+ * retries are due.  Never returns.
+ */
+void queue_daemon(queue_deliver_t deliver);
+
+/** Print a listing of the selected messages, from the queue index. */
+void queue_list(void);
+
+/** Number of selected messages, from the queue index. */
+int queue_count(void);
+
+#endif
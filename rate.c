@@ -0,0 +1,210 @@
+/**
+ * \file rate.c
+ * Rate limits of the identities.
+ *
+ * Each identity with limits has a pair of token buckets, for its messages
+ * and its recipients, in a table mapped from a file of the queue directory by
+ * all the processes sending mail, and updated under an exclusive lock.  A
+ * bucket holds a tenth of its limit and is refilled at a rate such that the
+ * limit is never exceeded over any minute, or hour, so that the relay's own
+ * quota is approached but never tripped.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "rate.h"
+#include "main.h"
+#include "queue.h"
+#include "xmalloc.h"
+
+
+#define RATE_FILE	"rates"
+#define RATE_MAGIC	"ESMTPRL"
+#define RATE_VERSION	1
+#define RATE_BUCKETS	64	/**< identities with limits tracked at once */
+#define RATE_KEY_SIZE	128	/**< longest identity address kept, plus one */
+
+/** Token bucket */
+typedef struct {
+	double tokens;
+	double stamp;		/**< when last refilled, in seconds */
+} rate_bucket_t;
+
+/** Buckets of an identity */
+typedef struct {
+	char key[RATE_KEY_SIZE];	/**< address of the identity */
+	double used;			/**< when last used, zero if free */
+	rate_bucket_t messages;
+	rate_bucket_t recipients;
+} rate_entry_t;
+
+typedef struct {
+	char magic[8];
+	unsigned version;
+	rate_entry_t entries[RATE_BUCKETS];
+} rate_table_t;
+
+/** The shared table, mapped on first use, or NULL if it couldn't be */
+static rate_table_t *rate_table = NULL;
+static int rate_fd = -1;
+
+/** Map the shared table, creating it if needed */
+static rate_table_t *rate_open(void)
+{
+	struct stat statbuf;
+	const char *dir;
+	char *path;
+	void *map;
+
+	if (rate_fd >= 0)
+		return rate_table;
+
+	dir = queue_directory();
+	path = xmalloc(strlen(dir) + strlen(RATE_FILE) + 2);
+	sprintf(path, "%s/%s", dir, RATE_FILE);
+
+	/* Without it the limits aren't enforced, rather than blocking mail */
+	if ((rate_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 ||
+	    fstat(rate_fd, &statbuf) < 0 ||
+	    (statbuf.st_size < (off_t)sizeof(rate_table_t) &&
+	     ftruncate(rate_fd, sizeof(rate_table_t)) < 0) ||
+	    (map = mmap(NULL, sizeof(rate_table_t), PROT_READ | PROT_WRITE, MAP_SHARED, rate_fd, 0)) == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(path);
+		return NULL;
+	}
+	free(path);
+
+	rate_table = (rate_table_t *)map;
+
+	return rate_table;
+}
+
+/** Find the entry of an identity, reusing the least recently used one if needed */
+static rate_entry_t *rate_entry(rate_table_t *table, const char *key, double now)
+{
+	rate_entry_t *entry, *oldest = NULL;
+	int i;
+
+	for (i = 0; i < RATE_BUCKETS; i++)
+	{
+		entry = &table->entries[i];
+		if (entry->used && !strncmp(entry->key, key, RATE_KEY_SIZE - 1))
+			goto found;
+
+		if (!oldest || entry->used < oldest->used)
+			oldest = entry;
+	}
+
+	/* New identities start with full buckets, as capped by the refill */
+	entry = oldest;
+	memset(entry, 0, sizeof(rate_entry_t));
+	strncpy(entry->key, key, RATE_KEY_SIZE - 1);
+	entry->messages.tokens = entry->recipients.tokens = 1e9;
+	entry->messages.stamp = entry->recipients.stamp = now;
+
+found:
+	entry->used = now;
+
+	return entry;
+}
+
+/**
+ * Refill a bucket for a limit of \p limit per \p period seconds.
+ *
+ * \return the seconds until it holds \p needed tokens, or as many as it can.
+ */
+static double rate_refill(rate_bucket_t *bucket, int limit, int period, int needed, double now)
+{
+	double capacity, rate;
+
+	/* A full bucket at the start of the period and what flows in over it
+	 * make up the limit, unless the bucket alone does, e.g. for a limit of
+	 * one, then it's only refilled once the period is over.
+	 */
+	capacity = limit / 10 ? limit / 10 : 1;
+	if (capacity < limit)
+		rate = (limit - capacity) / period;
+	else
+		rate = (double) limit / period;
+
+	if (now > bucket->stamp)
+		bucket->tokens += (now - bucket->stamp) * rate;
+	if (bucket->tokens > capacity)
+		bucket->tokens = capacity;
+	bucket->stamp = now;
+
+	/* More than a full bucket goes once it's full, running it into debt */
+	if (needed > capacity)
+		needed = capacity;
+
+	return bucket->tokens >= needed ? 0.0 : (needed - bucket->tokens) / rate;
+}
+
+int rate_take(identity_t *identity, int recipients)
+{
+	rate_table_t *table;
+	rate_entry_t *entry;
+	struct timeval tv;
+	double now, wait = 0.0, w;
+
+	if (!identity->messages_per_minute && !identity->recipients_per_hour)
+		return 0;
+
+	if (!(table = rate_open()))
+		return 0;
+
+	if (flock(rate_fd, LOCK_EX) < 0)
+	{
+		perror("flock");
+		exit(EX_OSERR);
+	}
+
+	if (memcmp(table->magic, RATE_MAGIC, sizeof(RATE_MAGIC)) || table->version != RATE_VERSION)
+	{
+		memset(table, 0, sizeof(rate_table_t));
+		memcpy(table->magic, RATE_MAGIC, sizeof(RATE_MAGIC));
+		table->version = RATE_VERSION;
+	}
+
+	gettimeofday(&tv, NULL);
+	now = tv.tv_sec + tv.tv_usec / 1e6;
+
+	entry = rate_entry(table, identity->address ? identity->address : "", now);
+
+	if (identity->messages_per_minute)
+		wait = rate_refill(&entry->messages, identity->messages_per_minute, 60, 1, now);
+	if (identity->recipients_per_hour &&
+	    (w = rate_refill(&entry->recipients, identity->recipients_per_hour, 60 * 60, recipients, now)) > wait)
+		wait = w;
+
+	if (wait == 0.0)
+	{
+		if (identity->messages_per_minute)
+			entry->messages.tokens -= 1;
+		if (identity->recipients_per_hour)
+			entry->recipients.tokens -= recipients;
+	}
+
+	flock(rate_fd, LOCK_UN);
+
+	if (verbose && wait > 0.0)
+		fprintf(stderr, "Rate limit of %s reached for %.0f seconds\n",
+			identity->address ? identity->address : "the default identity", wait);
+
+	/* whole seconds, rounding up */
+	return wait > 0.0 ? (int)wait + 1 : 0;
+}
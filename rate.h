@@ -0,0 +1,22 @@
+/**
+ * \file rate.h
+ * Rate limits of the identities.
+ */
+
+#ifndef _RATE_H
+#define _RATE_H
+
+
+#include "smtp.h"
+
+
+/**
+ * Take the sending of a message to \p recipients recipients from the rate
+ * limits of \p identity, shared by all the processes queueing into the same
+ * queue directory.  Nothing is taken unless it's within them.
+ *
+ * \return zero if it's within them, or else the seconds to wait until it is.
+ */
+int rate_take(identity_t *identity, int recipients);
+
+#endif
@@ -0,0 +1,504 @@
+/**
+ * \file rccache.c
+ * Precompiled configuration cache.
+ *
+ * When enabled, the configuration is saved after parsing into a binary
+ * snapshot in ~/.esmtprc.cache.XXXXXXXX, after a hash of the configuration
+ * file's path, which later invocations map and load the identities from
+ * instead of lexing and parsing the configuration file again.  The snapshot
+ * records the device, inode, size, modification and change times of the
+ * configuration file it was compiled from and is ignored as soon as any of
+ * them differs.
+ *
+ * As the snapshot holds the passwords, only configuration files private to
+ * the user are cached, not e.g. a system one the user may only read through
+ * the setgid bit.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rcfile.h"
+#include "hash.h"
+#include "main.h"
+#include "smtp.h"
+#include "local.h"
+#include "lmtp.h"
+#include "message.h"
+#include "queue.h"
+#include "xmalloc.h"
+
+
+int config_cache = 0;
+
+#define RCCACHE_FILE	".esmtprc.cache"
+#define RCCACHE_MAGIC	"ESMTPRC"
+#define RCCACHE_VERSION	10
+
+/**
+ * Snapshot header, followed by the path of the configuration file and the
+ * configuration itself.
+ */
+typedef struct {
+	char magic[8];
+	unsigned version;
+	unsigned size;		/**< total size of the snapshot */
+	dev_t dev;
+	ino_t ino;
+	off_t st_size;
+	time_t mtime;
+	time_t ctime;
+} rccache_header_t;
+
+/** String members of identity_t, in snapshot order */
+static const size_t identity_strings[] = {
+	offsetof(identity_t, address),
+	offsetof(identity_t, route),
+	offsetof(identity_t, host),
+	offsetof(identity_t, user),
+	offsetof(identity_t, pass),
+	offsetof(identity_t, certificate_passphrase),
+	offsetof(identity_t, preconnect),
+	offsetof(identity_t, postconnect),
+	offsetof(identity_t, qualifydomain),
+	offsetof(identity_t, helo),
+	offsetof(identity_t, force_reverse_path),
+	offsetof(identity_t, force_sender),
+};
+
+#define IDENTITY_STRING(identity, i) \
+	(*(char **)((char *)(identity) + identity_strings[i]))
+
+#define NIDENTITY_STRINGS (sizeof(identity_strings) / sizeof(identity_strings[0]))
+
+
+/** Snapshot of \p rcfile, named after a hash of its real path */
+static char *rccache_path(const char *rcfile)
+{
+	char *home, *path, *real;
+	unsigned hash;
+
+	if (!(home = getenv("HOME")))
+		return NULL;
+
+	real = realpath(rcfile, NULL);
+	hash = hash_string(real ? real : rcfile);
+	free(real);
+
+	path = xmalloc(strlen(home) + strlen(RCCACHE_FILE) + 11);
+	strcpy(path, home);
+	if (path[0] && path[strlen(path) - 1] != '/')
+		strcat(path, "/");
+	sprintf(path + strlen(path), "%s.%08X", RCCACHE_FILE, hash);
+
+	return path;
+}
+
+/**
+ * Header expected of the snapshot of \p rcfile, as long as it may be cached,
+ * i.e., it's a regular file of the user which only the user may read, by the
+ * rules of rcfile_check() but without complaining.
+ */
+static int rccache_stat(const char *rcfile, rccache_header_t *header)
+{
+	struct stat statbuf;
+
+	if (lstat(rcfile, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) ||
+	    (statbuf.st_mode & (S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH | S_IXOTH)))
+		return -1;
+#ifdef HAVE_GETEUID
+	if (statbuf.st_uid != geteuid())
+#else
+	if (statbuf.st_uid != getuid())
+#endif
+		return -1;
+
+	memset(header, 0, sizeof(rccache_header_t));
+	memcpy(header->magic, RCCACHE_MAGIC, sizeof(RCCACHE_MAGIC));
+	header->version = RCCACHE_VERSION;
+	header->dev = statbuf.st_dev;
+	header->ino = statbuf.st_ino;
+	header->st_size = statbuf.st_size;
+	header->mtime = statbuf.st_mtime;
+	header->ctime = statbuf.st_ctime;
+
+	return 0;
+}
+
+
+/**
+ * \name Writing
+ */
+/*@{*/
+
+static void put_int(FILE *fp, int value)
+{
+	fwrite(&value, sizeof(value), 1, fp);
+}
+
+/** Strings are stored as their length plus one (zero for NULL) and the bytes */
+static void put_string(FILE *fp, const char *s)
+{
+	if (!s)
+		put_int(fp, 0);
+	else
+	{
+		int len = strlen(s);
+
+		put_int(fp, len + 1);
+		fwrite(s, 1, len + 1, fp);
+	}
+}
+
+static void put_identity(FILE *fp, identity_t *identity)
+{
+	unsigned i;
+
+	for (i = 0; i < NIDENTITY_STRINGS; i++)
+		put_string(fp, IDENTITY_STRING(identity, i));
+
+	put_int(fp, identity->starttls);
+	put_int(fp, identity->prohibit_msgid);
+	put_int(fp, identity->priority);
+	put_int(fp, identity->messages_per_minute);
+	put_int(fp, identity->recipients_per_hour);
+	put_int(fp, identity->sessions);
+	put_int(fp, identity->session_idle);
+	put_int(fp, identity->session_messages);
+}
+
+void rccache_save(const char *rcfile)
+{
+	rccache_header_t header;
+	struct list_head *ptr;
+	char *path, *tmp;
+	FILE *fp;
+	int fd, n, i;
+
+	if (rccache_stat(rcfile, &header) < 0 || !(path = rccache_path(rcfile)))
+		return;
+
+	tmp = xmalloc(strlen(path) + 16);
+	sprintf(tmp, "%s.%d", path, (int)getpid());
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0 || !(fp = fdopen(fd, "w")))
+	{
+		if (verbose)
+			fprintf(stderr, "open: %s: %s\n", tmp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		goto done;
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+	put_string(fp, rcfile);
+
+	/* Globals */
+	put_string(fp, mda);
+	put_string(fp, force_mda);
+	put_string(fp, lmtp);
+	put_int(fp, mda_workers);
+	put_int(fp, local_resolve);
+	put_int(fp, long_lines);
+	put_int(fp, body_type_auto);
+	put_int(fp, declare_size);
+	put_int(fp, chunk_size);
+	put_string(fp, queue_dir);
+
+	for (n = 0; local_domains && local_domains[n]; n++)
+		;
+	put_int(fp, n);
+	for (i = 0; i < n; i++)
+		put_string(fp, local_domains[i]);
+
+	/* Identities, oldest first so that reloading them with identity_add()
+	 * restores the list order */
+	n = 0;
+	list_for_each(ptr, &identities)
+		n++;
+	put_int(fp, n);
+
+	list_for_each_prev(ptr, &identities)
+	{
+		identity_t *identity = list_entry(ptr, identity_t, list);
+
+		put_identity(fp, identity);
+		if (identity == default_identity)
+			put_int(fp, 1);
+		else
+			put_int(fp, 0);
+	}
+
+	/* Routes, likewise */
+	n = 0;
+	list_for_each(ptr, &routes)
+		n++;
+	put_int(fp, n);
+
+	list_for_each_prev(ptr, &routes)
+		put_identity(fp, list_entry(ptr, identity_t, list));
+
+	/* Patch in the final size */
+	fflush(fp);
+	header.size = ftell(fp);
+	rewind(fp);
+	fwrite(&header, sizeof(header), 1, fp);
+
+	if (fclose(fp) || rename(tmp, path) < 0)
+		unlink(tmp);
+
+done:
+	free(tmp);
+	free(path);
+}
+
+void rccache_remove(const char *rcfile)
+{
+	char *path;
+
+	if ((path = rccache_path(rcfile)))
+	{
+		unlink(path);
+		free(path);
+	}
+}
+
+/*@}*/
+
+
+/**
+ * \name Loading
+ */
+/*@{*/
+
+/** Reading cursor over the mapped snapshot */
+typedef struct {
+	const char *p, *end;
+	int error;
+} cursor_t;
+
+static int get_int(cursor_t *c)
+{
+	int value;
+
+	if (c->error || c->end - c->p < (ptrdiff_t)sizeof(value))
+	{
+		c->error = 1;
+		return 0;
+	}
+
+	memcpy(&value, c->p, sizeof(value));
+	c->p += sizeof(value);
+
+	return value;
+}
+
+/** Returns a pointer into the mapping; copy it to keep it */
+static const char *get_string(cursor_t *c)
+{
+	const char *s;
+	int len;
+
+	if (!(len = get_int(c)))
+		return NULL;
+
+	if (c->error || len < 0 || c->end - c->p < len || c->p[len - 1] != '\0')
+	{
+		c->error = 1;
+		return NULL;
+	}
+
+	s = c->p;
+	c->p += len;
+
+	return s;
+}
+
+/** Copy a string, unless just validating */
+static char *dup_string(cursor_t *c, int apply)
+{
+	const char *s = get_string(c);
+
+	return s && apply ? arena_strdup(config_arena, s) : NULL;
+}
+
+/** Read an identity, returning NULL unless applying */
+static identity_t *get_identity(cursor_t *c, int apply)
+{
+	identity_t identity, *new;
+	unsigned j;
+
+	memset(&identity, 0, sizeof(identity));
+	for (j = 0; j < NIDENTITY_STRINGS; j++)
+		IDENTITY_STRING(&identity, j) = dup_string(c, apply);
+
+	identity.starttls = get_int(c);
+	identity.prohibit_msgid = get_int(c);
+	identity.priority = get_int(c);
+	identity.messages_per_minute = get_int(c);
+	identity.recipients_per_hour = get_int(c);
+	identity.sessions = get_int(c);
+	identity.session_idle = get_int(c);
+	identity.session_messages = get_int(c);
+
+	if (!apply)
+		return NULL;
+
+	new = identity_new();
+	identity.list = new->list;
+	*new = identity;
+
+	return new;
+}
+
+/**
+ * Walk the configuration in the snapshot.
+ *
+ * \param apply whether to actually load it, or just validate it.
+ *
+ * \return nonzero if the snapshot is well formed.
+ */
+static int rccache_walk(cursor_t *c, int apply)
+{
+	char *s;
+	int n, i, value;
+
+	/* Globals */
+	s = dup_string(c, apply);
+	if (apply) mda = s;
+	s = dup_string(c, apply);
+	if (apply) force_mda = s;
+	s = dup_string(c, apply);
+	if (apply) lmtp = s;
+	value = get_int(c);
+	if (apply) mda_workers = value;
+	value = get_int(c);
+	if (apply) local_resolve = value;
+	value = get_int(c);
+	if (apply) long_lines = (enum long_lines)value;
+	value = get_int(c);
+	if (apply) body_type_auto = value;
+	value = get_int(c);
+	if (apply) declare_size = value;
+	value = get_int(c);
+	if (apply) chunk_size = value;
+	s = dup_string(c, apply);
+	if (apply) queue_dir = s;
+
+	n = get_int(c);
+	for (i = 0; i < n && !c->error; i++)
+	{
+		const char *domain = get_string(c);
+
+		if (domain && apply)
+			local_domain_add(domain);
+	}
+
+	/* Identities */
+	n = get_int(c);
+	for (i = 0; i < n && !c->error; i++)
+	{
+		identity_t *identity = get_identity(c, apply);
+
+		value = get_int(c);
+		if (identity)
+		{
+			identity_add(identity);
+			if (value)
+				default_identity = identity;
+		}
+	}
+
+	/* Routes */
+	n = get_int(c);
+	for (i = 0; i < n && !c->error; i++)
+	{
+		identity_t *identity = get_identity(c, apply);
+
+		if (identity)
+			list_add(&identity->list, &routes);
+	}
+
+	return !c->error && c->p == c->end;
+}
+
+int rccache_load(const char *rcfile)
+{
+	rccache_header_t expected;
+	const rccache_header_t *header;
+	struct stat statbuf;
+	cursor_t cursor;
+	const char *source;
+	char *path;
+	void *map;
+	int fd, ok = 0;
+
+	if (rccache_stat(rcfile, &expected) < 0 || !(path = rccache_path(rcfile)))
+		return 0;
+
+	/* Same rules as for the user configuration file */
+	if ((fd = open(path, O_RDONLY)) < 0 || rcfile_check(path, 1) < 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		free(path);
+		return 0;
+	}
+	free(path);
+
+	if (fstat(fd, &statbuf) < 0 || statbuf.st_size < (off_t)sizeof(rccache_header_t) ||
+	    (map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	header = (const rccache_header_t *)map;
+	expected.size = header->size;
+	if (memcmp(header, &expected, sizeof(expected)) || header->size != statbuf.st_size)
+		goto done;
+
+	cursor.p = (const char *)map + sizeof(rccache_header_t);
+	cursor.end = (const char *)map + statbuf.st_size;
+	cursor.error = 0;
+
+	if (!(source = get_string(&cursor)) || strcmp(source, rcfile))
+		goto done;
+
+	/* Validate everything before touching the configuration, so that a
+	 * damaged snapshot just falls back to parsing */
+	{
+		cursor_t check = cursor;
+
+		if (!rccache_walk(&check, 0))
+		{
+			if (verbose)
+				fprintf(stderr, "Ignoring damaged configuration cache\n");
+			goto done;
+		}
+	}
+
+	ok = rccache_walk(&cursor, 1);
+
+	if (verbose)
+		fprintf(stdout, "Loaded configuration cache for %s\n", rcfile);
+
+done:
+	munmap(map, statbuf.st_size);
+
+	return ok;
+}
+
+/*@}*/
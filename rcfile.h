@@ -6,6 +6,45 @@
 #ifndef _RCFILE_H
 #define _RCFILE_H
 
+
+#include "arena.h"
+
+
+/**
+ * Arena holding the configuration: identities, routes and their strings,
+ * plus the strings of the global options.
+ */
+extern arena_t *config_arena;
+
 extern void rcfile_parse(const char *rcfile);
 
+/** Release the configuration, after identities_cleanup() */
+extern void rcfile_cleanup(void);
+
+/** Check that a configuration file is secure */
+extern int rcfile_check(const char *pathname, const int securecheck);
+
+/** \name Precompiled configuration cache */
+/*@{*/
+
+/** Whether to save the configuration into the cache after parsing it */
+extern int config_cache;
+
+/**
+ * Load the configuration from the cache, if it is up to date with respect
+ * to \p rcfile.  Only configuration files owned by the user and private to
+ * them are cached.
+ *
+ * \return nonzero if loaded.
+ */
+extern int rccache_load(const char *rcfile);
+
+/** Save the parsed configuration of \p rcfile into the cache */
+extern void rccache_save(const char *rcfile);
+
+/** Remove the cache of \p rcfile */
+extern void rccache_remove(const char *rcfile);
+
+/*@}*/
+
 #endif
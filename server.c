@@ -0,0 +1,425 @@
+/**
+ * \file server.c
+ * SMTP server on standard input and output (RFC 5321), as of -bs.
+ *
+ * Just enough of it for local programs to submit many messages over a pipe.
+ * The commands are read through a buffer of our own, and the replies are
+ * only written once it's used up, so that a client pipelining its commands
+ * (RFC 2920) gets the replies to each group of them at once.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "main.h"
+#include "xmalloc.h"
+
+#ifndef MAXHOSTNAMELEN
+#define MAXHOSTNAMELEN 256
+#endif
+
+
+#define SERVER_LINE	1000	/**< longest command line, with its CRLF */
+#define SERVER_BUFFER	8192	/**< input buffer size */
+
+/** \name Connection state */
+/*@{*/
+static char server_buffer[SERVER_BUFFER];	/**< commands and data read ahead */
+static size_t server_start, server_stop;	/**< what's left of them */
+static FILE *server_out = NULL;			/**< replies to the client */
+/*@}*/
+
+
+/**
+ * Refill the input buffer, sending the replies given so far first, as the
+ * client may be waiting for them.
+ *
+ * \return zero at the end of the input.
+ */
+static int server_fill(void)
+{
+	ssize_t count;
+
+	if (fflush(server_out))
+		return 0;
+
+	while ((count = read(STDIN_FILENO, server_buffer, SERVER_BUFFER)) < 0)
+		if (errno != EINTR)
+		{
+			perror("read");
+			return 0;
+		}
+
+	server_start = 0;
+	server_stop = count;
+
+	return count > 0;
+}
+
+/**
+ * Read a line, or as much of it as fits in \p size - 1 octets.
+ *
+ * \return its length, zero at the end of the input.  It ends with a newline
+ * unless it was cut short.
+ */
+static size_t server_getline(char *line, size_t size)
+{
+	size_t n = 0, k;
+	char *nl = NULL;
+
+	while (!nl && n < size - 1)
+	{
+		if (server_start == server_stop && !server_fill())
+			break;
+
+		k = server_stop - server_start;
+		if (k > size - 1 - n)
+			k = size - 1 - n;
+		if ((nl = memchr(server_buffer + server_start, '\n', k)))
+			k = nl + 1 - (server_buffer + server_start);
+
+		memcpy(line + n, server_buffer + server_start, k);
+		server_start += k;
+		n += k;
+	}
+
+	line[n] = '\0';
+
+	return n;
+}
+
+static void server_reply(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(server_out, format, ap);
+	va_end(ap);
+	fputs("\r\n", server_out);
+
+	if (log_fp)
+	{
+		fputs("S: ", log_fp);
+		va_start(ap, format);
+		vfprintf(log_fp, format, ap);
+		va_end(ap);
+		fputc('\n', log_fp);
+	}
+}
+
+/** Reply to a message handed over, after its status */
+static void server_reply_status(int status, const char *id)
+{
+	switch (status)
+	{
+		case EX_OK:
+			if (id)
+				server_reply("250 Ok: queued as %s", id);
+			else
+				server_reply("250 Ok");
+			break;
+
+		case EX_DATAERR:
+		case EX_NOUSER:
+		case EX_NOHOST:
+		case EX_UNAVAILABLE:
+		case EX_NOPERM:
+			server_reply("554 Transaction failed");
+			break;
+
+		default:
+			server_reply("451 Local error in processing");
+			break;
+	}
+}
+
+/**
+ * Parse the path of a MAIL or RCPT command, i.e., what follows its "FROM:" or
+ * "TO:", dropping any source route.
+ *
+ * \param params set to the parameters following it.
+ *
+ * \return the address, or NULL if it's malformed.
+ */
+static char *server_path(char *arg, char **params)
+{
+	char *end, *p;
+
+	while (*arg == ' ')
+		arg++;
+
+	if (*arg == '<')
+	{
+		if (!(end = strchr(++arg, '>')))
+			return NULL;
+		*end++ = '\0';
+	}
+	else
+	{
+		/* leniently, a bare address */
+		end = arg + strcspn(arg, " ");
+		if (*end)
+			*end++ = '\0';
+	}
+
+	/* e.g. "@a,@b:user@c" */
+	if (*arg == '@' && (p = strchr(arg, ':')))
+		arg = p + 1;
+
+	while (*end == ' ')
+		end++;
+	*params = end;
+
+	return arg;
+}
+
+/** Start a message with the delivery options of \p defaults */
+static message_t *server_message(const message_t *defaults)
+{
+	message_t *message;
+
+	message = message_new();
+	message->ret = defaults->ret;
+	message->notify = defaults->notify;
+	message->body = defaults->body;
+	message->priority = defaults->priority;
+
+	return message;
+}
+
+static void server_reset(message_t **message)
+{
+	if (*message)
+	{
+		message_free(*message);
+		*message = NULL;
+	}
+}
+
+/**
+ * Read the data of a message, up to the line with a single dot, into a
+ * temporary file, which the message is read from afterwards.
+ *
+ * \return zero if the input ended first.
+ */
+static int server_data(message_t *message)
+{
+	char line[SERVER_BUFFER];
+	size_t n;
+	int bol = 1;
+	FILE *fp;
+
+	if (!(fp = tmpfile()))
+	{
+		perror("tmpfile");
+		exit(EX_CANTCREAT);
+	}
+
+	while ((n = server_getline(line, sizeof(line))))
+	{
+		char *p = line;
+		int eol = line[n - 1] == '\n';
+
+		/* the end, or else a dot stuffed in */
+		if (bol && *p == '.')
+		{
+			if ((n == 3 && !memcmp(p, ".\r\n", 3)) || (n == 2 && !memcmp(p, ".\n", 2)))
+				break;
+			p++;
+			n--;
+		}
+
+		fwrite(p, 1, n, fp);
+		bol = eol;
+	}
+
+	if (!n)
+	{
+		fclose(fp);
+		return 0;
+	}
+
+	if (fflush(fp) || ferror(fp))
+	{
+		perror("tmpfile");
+		exit(EX_IOERR);
+	}
+	rewind(fp);
+
+	message->fp = fp;
+
+	return 1;
+}
+
+void server_run(const message_t *defaults, server_accept_t accept)
+{
+	char line[SERVER_LINE + 1], host[MAXHOSTNAMELEN], *arg, *path, *params, *p, *id;
+	message_t *message = NULL;
+	size_t n;
+	int fd, status;
+
+	/* The replies get the client's end to themselves */
+	fflush(stdout);
+	if ((fd = dup(STDOUT_FILENO)) < 0 || !(server_out = fdopen(fd, "w")) ||
+	    dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+	{
+		perror("dup");
+		exit(EX_OSERR);
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (gethostname(host, sizeof(host)))
+		strcpy(host, "localhost");
+
+	server_reply("220 %s ESMTP esmtp", host);
+
+	while ((n = server_getline(line, sizeof(line))))
+	{
+		if (line[n - 1] != '\n' && n == sizeof(line) - 1)
+		{
+			/* skip the rest of it */
+			while ((n = server_getline(line, sizeof(line))) && line[n - 1] != '\n')
+				;
+			server_reply("500 Line too long");
+			continue;
+		}
+
+		while (n && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+
+		if (log_fp)
+			fprintf(log_fp, "C: %s\n", line);
+
+		arg = line + strcspn(line, " ");
+		if (*arg)
+			*arg++ = '\0';
+
+		if (!strcasecmp(line, "HELO") || !strcasecmp(line, "EHLO"))
+		{
+			if (!*arg)
+			{
+				server_reply("501 Syntax: %s hostname", line);
+				continue;
+			}
+
+			server_reset(&message);
+			if (!strcasecmp(line, "EHLO"))
+			{
+				server_reply("250-%s", host);
+				server_reply("250-PIPELINING");
+				server_reply("250 8BITMIME");
+			}
+			else
+				server_reply("250 %s", host);
+		}
+		else if (!strcasecmp(line, "MAIL"))
+		{
+			if (message)
+			{
+				server_reply("503 Nested MAIL command");
+				continue;
+			}
+
+			if (strncasecmp(arg, "FROM:", 5) || !(path = server_path(arg + 5, &params)))
+			{
+				server_reply("501 Syntax: MAIL FROM:<address>");
+				continue;
+			}
+
+			message = server_message(defaults);
+			for (p = strtok(params, " "); p; p = strtok(NULL, " "))
+				if (!strcasecmp(p, "BODY=8BITMIME"))
+					message->body = E8bitmime_8BITMIME;
+				else if (!strcasecmp(p, "BODY=7BIT"))
+					message->body = E8bitmime_7BIT;
+				else
+					break;
+
+			if (p)
+			{
+				server_reply("555 Unsupported parameter %s", p);
+				server_reset(&message);
+				continue;
+			}
+
+			/* an empty one being the null reverse path, of returns */
+			message_set_reverse_path(message, path);
+			server_reply("250 Ok");
+		}
+		else if (!strcasecmp(line, "RCPT"))
+		{
+			if (!message)
+				server_reply("503 Need MAIL command");
+			else if (strncasecmp(arg, "TO:", 3) || !(path = server_path(arg + 3, &params)) || !*path)
+				server_reply("501 Syntax: RCPT TO:<address>");
+			else if (*params)
+				server_reply("555 Unsupported parameter %s", params);
+			else
+			{
+				message_add_recipient(message, path);
+				server_reply("250 Ok");
+			}
+		}
+		else if (!strcasecmp(line, "DATA"))
+		{
+			if (!message)
+				server_reply("503 Need MAIL command");
+			else if (list_empty(&message->remote_recipients) && list_empty(&message->local_recipients))
+				server_reply("554 No valid recipients");
+			else if (*arg)
+				server_reply("501 Syntax: DATA");
+			else
+			{
+				server_reply("354 End data with <CR><LF>.<CR><LF>");
+				if (!server_data(message))
+					break;
+
+				id = NULL;
+				status = accept(message, &id);
+				server_reply_status(status, id);
+				free(id);
+				server_reset(&message);
+			}
+		}
+		else if (!strcasecmp(line, "RSET"))
+		{
+			server_reset(&message);
+			server_reply("250 Ok");
+		}
+		else if (!strcasecmp(line, "NOOP"))
+			server_reply("250 Ok");
+		else if (!strcasecmp(line, "VRFY"))
+			server_reply("252 Cannot VRFY user, but will accept message");
+		else if (!strcasecmp(line, "QUIT"))
+		{
+			server_reply("221 %s closing connection", host);
+			break;
+		}
+		else
+			server_reply("500 Command unrecognized");
+	}
+
+	server_reset(&message);
+
+	/* So that the client is done while the messages are delivered */
+	server_detach();
+}
+
+void server_detach(void)
+{
+	if (server_out)
+	{
+		fclose(server_out);
+		server_out = NULL;
+	}
+}
@@ -0,0 +1,44 @@
+/**
+ * \file server.h
+ * SMTP server on standard input and output, as of -bs.
+ */
+
+#ifndef _SERVER_H
+#define _SERVER_H
+
+
+#include "message.h"
+
+
+/**
+ * Take a message received by server_run(), e.g., by queueing it.  Its data is
+ * read from \c message->fp, and it's freed afterwards by server_run().
+ *
+ * \param id set to the queue id to give in the reply, to be freed by the
+ * caller, or left NULL.
+ *
+ * \return a sysexits status: EX_OK once taken, EX_TEMPFAIL or another
+ * temporary failure for the client to try again, or else a permanent one.
+ */
+typedef int (*server_accept_t)(message_t *message, char **id);
+
+/**
+ * Speak SMTP on standard input and output until the client quits, handing
+ * each message received to \p accept.  Clients may pipeline their commands,
+ * the replies to them being written at once when they wait for them.
+ *
+ * Standard output is redirected to standard error meanwhile, so that nothing
+ * else written to it mixes with the replies.
+ *
+ * \param defaults message with the delivery options to start each message
+ * received with, e.g., those of the command line.
+ */
+void server_run(const message_t *defaults, server_accept_t accept);
+
+/**
+ * Close the connection to the client, e.g., in a child process outliving
+ * it, once the replies are flushed.
+ */
+void server_detach(void);
+
+#endif
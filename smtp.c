@@ -7,6 +7,7 @@
 
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -22,7 +23,11 @@
 #include <libesmtp.h>
 
 #include "smtp.h"
+#include "hash.h"
+#include "domain.h"
 #include "main.h"
+#include "local.h"
+#include "rcfile.h"
 #include "xmalloc.h"
 
 #ifndef MAXHOSTNAMELEN
@@ -37,13 +42,13 @@
 
 identity_t *default_identity = NULL;
 
-static LIST_HEAD(identities);
+LIST_HEAD(identities);
 
 identity_t *identity_new(void)
 {
 	identity_t *identity;
 
-	identity = (identity_t *)xmalloc(sizeof(identity_t));
+	identity = (identity_t *)arena_alloc(config_arena, sizeof(identity_t));
 
 	memset(identity, 0, sizeof(identity_t));
 
@@ -52,91 +57,123 @@ identity_t *identity_new(void)
 	return identity;
 }
 
-void identity_free(identity_t *identity)
+void identity_add(identity_t *identity)
 {
-	if(identity->address)
-		free(identity->address);
+	list_add(&identity->list, &identities);
+}
 
-	if(identity->host)
-		free(identity->host);
+/*
+ * Identity index, built once after the configuration is parsed.  Identities
+ * whose address is of the form "*@domain" (or "*@*.domain" for its
+ * subdomains) are selected for every sender in that domain which has no
+ * identity of its own.
+ */
 
-	if(identity->user)
-		free(identity->user);
+static hash_t *identity_addresses = NULL;	/**< exact addresses */
+static domain_map_t *identity_domains = NULL;	/**< "*@" patterns */
 
-	if(identity->pass)
-		free(identity->pass);
+LIST_HEAD(routes);
+static domain_map_t *route_domains = NULL;
 
-	if(identity->certificate_passphrase)
-		free(identity->certificate_passphrase);
+void route_add(identity_t *identity, const char *pattern)
+{
+	identity->route = arena_strdup(config_arena, pattern);
+	list_add(&identity->list, &routes);
+}
 
-	if(identity->preconnect)
-		free(identity->preconnect);
+void identities_init(void)
+{
+	struct list_head *ptr;
 
-	if(identity->postconnect)
-		free(identity->postconnect);
+	if (identity_addresses)
+		return;
 
-	if(identity->qualifydomain)
-		free(identity->qualifydomain);
+	identity_addresses = hash_new();
+	identity_domains = domain_map_new();
 
-	if(identity->helo)
-		free(identity->helo);
+	/* The most recently defined identity takes precedence */
+	list_for_each(ptr, &identities)
+	{
+		identity_t *identity;
+			
+		identity = list_entry(ptr, identity_t, list);
+		if(!identity->address)
+			continue;
 
-	if(identity->force_reverse_path)
-		free(identity->force_reverse_path);
+		if(!strncmp(identity->address, "*@", 2))
+			domain_map_add(identity_domains, identity->address + 2, identity);
+		else
+			hash_insert(identity_addresses, identity->address, identity);
+	}
 
-	if(identity->force_sender)
-		free(identity->force_sender);
+	if(!list_empty(&routes))
+	{
+		route_domains = domain_map_new();
 
-	free(identity);
-}
+		list_for_each(ptr, &routes)
+		{
+			identity_t *route = list_entry(ptr, identity_t, list);
 
-void identity_add(identity_t *identity)
-{
-	list_add(&identity->list, &identities);
+			domain_map_add(route_domains, route->route, route);
+		}
+	}
 }
 
 identity_t *identity_lookup(const char *address)
 {
 	if(address)
 	{
-		struct list_head *ptr;
+		identity_t *identity;
+		const char *at;
 
-		list_for_each(ptr, &identities)
-		{
-			identity_t *identity;
-			
-			identity = list_entry(ptr, identity_t, list);
-			if(identity->address && !strcmp(identity->address, address))
-				return identity;
-		}
+		if(!identity_addresses)
+			identities_init();
+
+		if((identity = hash_lookup(identity_addresses, address)))
+			return identity;
+
+		if((at = strrchr(address, '@')) &&
+		   (identity = domain_map_lookup(identity_domains, at + 1)))
+			return identity;
 	}
 
 	return default_identity;
 }
-	
-void identities_init(void)
+
+identity_t *route_lookup(const char *address)
 {
+	const char *at;
+
+	if(!identity_addresses)
+		identities_init();
+
+	if(!route_domains || !(at = strrchr(address, '@')))
+		return NULL;
+
+	return domain_map_lookup(route_domains, at + 1);
 }
 
 void identities_cleanup(void)
 {
 	default_identity = NULL;
 
-	if(!list_empty(&identities))
+	if(identity_addresses)
 	{
-		struct list_head *ptr, *tmp;
-	
-		list_for_each_safe(ptr, tmp, &identities)
-		{
-			identity_t *identity;
-			
-			identity = list_entry(ptr, identity_t, list);
-			list_del(ptr);
-			
-			identity_free(identity);
-		}
+		hash_free(identity_addresses);
+		domain_map_free(identity_domains);
+		identity_addresses = NULL;
+		identity_domains = NULL;
+	}
 
+	if(route_domains)
+	{
+		domain_map_free(route_domains);
+		route_domains = NULL;
 	}
+
+	/* The identities themselves belong to the configuration arena */
+	INIT_LIST_HEAD(&routes);
+	INIT_LIST_HEAD(&identities);
 }
 	
 /*@}*/
@@ -147,6 +184,21 @@ void identities_cleanup(void)
  */
 /*@{*/
 
+int chunk_size = 65536;
+
+/**
+ * Message callback state.
+ *
+ * libESMTP keeps it for the whole session and frees it when the session is
+ * destroyed, so it is allocated in one block, with the chunk buffer, which
+ * gets reused for all the messages of the session.
+ */
+typedef struct {
+	message_t *message;	/**< message being read */
+	int size;		/**< size of the buffer */
+	char *data;		/**< chunk buffer, following this structure */
+} message_cb_t;
+
 /**
  * Callback function to read the message from a file.  
  *
@@ -156,25 +208,40 @@ void identities_cleanup(void)
 static const char * message_cb (void **buf, int *len, void *arg)
 {
 	message_t *message = (message_t *)arg;
+	message_cb_t *ctx = (message_cb_t *)*buf;
 
 	if (len == NULL)
 	{
-		/* only allow rewinding in the beginning of a message otherwise
-		 * it will break the pipes */
-		assert(*buf == NULL);
+		if (ctx && ctx->message == message)
+		{
+			/* only allow rewinding a message already read from if it
+			 * was spooled, otherwise it will break the pipes */
+			assert(message->spool_path);
+			message_reopen(message);
+		}
 		return NULL;
 	}
 
-	if (*buf == NULL)
-		*buf = malloc (BUFSIZ);
+	if (ctx == NULL)
+	{
+		ctx = (message_cb_t *)xmalloc(sizeof(message_cb_t) + chunk_size);
+		ctx->size = chunk_size;
+		ctx->data = (char *)(ctx + 1);
+		*buf = ctx;
+	}
+	ctx->message = message;
 
-	*len = message_read(message, *buf, BUFSIZ);
+	*len = message_read(message, ctx->data, ctx->size);
 	
-	return *buf;
+	return ctx->data;
 }
 
 #define SIZETICKER 1024		/**< print 1 dot per this many bytes */
 
+typedef struct linger_context linger_context_t;
+
+static void linger_next (smtp_session_t session, smtp_message_t message, linger_context_t *ctx);
+
 static void event_cb (smtp_session_t session, int event_no, void *arg, ...)
 {
 	va_list ap;
@@ -320,6 +387,14 @@ static void event_cb (smtp_session_t session, int event_no, void *arg, ...)
 	}
 		
 	va_end (ap);
+
+	/* Follow the last message with another, if lingering */
+	if (event_no == SMTP_EV_MESSAGESENT && arg)
+	{
+		va_start (ap, arg);
+		linger_next (session, va_arg (ap, smtp_message_t), (linger_context_t *)arg);
+		va_end (ap);
+	}
 }
 
 static void monitor_cb (const char *buf, int buflen, int writing, void *arg)
@@ -485,31 +560,65 @@ static char *escape_forced_address (char *mask)
 	
 }
 
-void smtp_send(message_t *msg, identity_t *identity)
+/** Execute a pre- or post-connect command, exiting if it fails */
+static void connect_command (const char *what, const char *command)
+{
+	int ret, exit_status;
+
+	if (verbose)
+		fprintf (stdout, "Executing %s command: %s\n", what, command);
+
+	ret = system (command);
+	exit_status = WEXITSTATUS(ret);
+
+	/* Check whether the child process caught a signal meant for us */
+	if (WIFSIGNALED(ret))
+	{
+		int sig = WTERMSIG(ret);
+
+		if (sig == SIGINT || sig == SIGQUIT)
+		{
+			fprintf (stderr, "%c%s command received signal %d\n", toupper(what[0]), what + 1, sig);
+			exit (EX_SOFTWARE);
+		}
+	}
+
+	if (ret == -1)
+	{
+		fprintf (stderr, "Error executing %s command\n", what);
+		exit (EX_OSERR);
+	}
+
+	if (exit_status != 0)
+	{
+		fprintf (stderr, "%c%s command \"%s\" exited with non-zero status %d\n",
+			 toupper(what[0]), what + 1, command, exit_status);
+		exit (EX_SOFTWARE);
+	}
+}
+
+/**
+ * Create a session for delivering via \p identity.
+ *
+ * \return NULL on failure, with smtp_errno() set.
+ */
+static smtp_session_t smtp_session_new(identity_t *identity, auth_context_t *authctx)
 {
 	smtp_session_t session;
-	smtp_message_t message;
-	smtp_recipient_t recipient;
-	auth_context_t authctx;
-	const smtp_status_t *status;
 	struct sigaction sa;
-	struct list_head *ptr;
 
-	/* This program sends only one message at a time.  Create an SMTP
-	 * session.
-	 */
-	auth_client_init ();
+	/* Create an SMTP session. */
 	if(!(session = smtp_create_session ()))
-		goto failure;
+		return NULL;
 
 	/* Add a protocol monitor. */
 	if(log_fp)
 		if(!smtp_set_monitorcb (session, monitor_cb, NULL, 1))
-			goto failure;
+			return NULL;
 
 	/* Set the event callback. */
 	if(!smtp_set_eventcb (session, event_cb, NULL))
-		goto failure;
+		return NULL;
 
 	/* NB.  libESMTP sets timeouts as it progresses through the protocol.  In
 	 * addition the remote server might close its socket on a timeout.
@@ -524,7 +633,7 @@ void smtp_send(message_t *msg, identity_t *identity)
 	if(identity->helo)
 	{
 		if(!smtp_set_hostname (session, identity->helo))
-			goto failure;
+			return NULL;
 	}
 
 	/* Set the host running the SMTP server.  LibESMTP has a default port
@@ -532,42 +641,55 @@ void smtp_send(message_t *msg, identity_t *identity)
 	 * specified as 25 along with the default MTA host.
 	 */
 	if(!smtp_set_server (session, identity->host ? identity->host : "localhost:25"))
-		goto failure;
+		return NULL;
 
 	/* Set the SMTP Starttls extension. */
 	if(identity->starttls && !smtp_starttls_enable (session, identity->starttls))
-		goto failure;
+		return NULL;
 
 	/* Do what's needed at application level to use authentication. */
 	if(identity->user || identity->pass)
 	{
-		authctx = auth_create_context ();
-		auth_set_mechanism_flags (authctx, AUTH_PLUGIN_PLAIN, 0);
-		auth_set_interact_cb (authctx, authinteract, identity);
+		*authctx = auth_create_context ();
+		auth_set_mechanism_flags (*authctx, AUTH_PLUGIN_PLAIN, 0);
+		auth_set_interact_cb (*authctx, authinteract, identity);
 	}
 	else
-		authctx = NULL;
+		*authctx = NULL;
 
 	/* Use our callback for X.509 certificate passwords.  If STARTTLS is not in
 	 * use or disabled in configure, the following is harmless.
 	 */
 	if(identity->starttls && !smtp_starttls_set_password_cb (tlsinteract, identity))
-		goto failure;
+		return NULL;
 
 	/* Now tell libESMTP it can use the SMTP AUTH extension. */
-	if(!smtp_auth_set_context (session, authctx))
-		goto failure;
+	if(!smtp_auth_set_context (session, *authctx))
+		return NULL;
 
 	/* At present it can't handle one recipient only out of many failing.  Make
 	 * libESMTP require all specified recipients to succeed before transferring
 	 * a message.
 	 */
 	if(!smtp_option_require_all_recipients (session, 1))
-		goto failure;
+		return NULL;
+
+	return session;
+}
+
+/**
+ * Add a message to a session.
+ *
+ * \return NULL on failure, with smtp_errno() set.
+ */
+static smtp_message_t smtp_message_add(smtp_session_t session, message_t *msg, identity_t *identity)
+{
+	smtp_message_t message;
+	smtp_recipient_t recipient;
+	struct list_head *ptr;
 
-	/* Add a message to the SMTP session. */
 	if(!(message = smtp_add_message (session)))
-		goto failure;
+		return NULL;
 
 	/* Set the reverse path for the mail envelope. */
 	if(identity->force_reverse_path)
@@ -579,27 +701,27 @@ void smtp_send(message_t *msg, identity_t *identity)
 		if(!smtp_set_reverse_path (message, value))
 		{
 			free(value);
-			goto failure;
+			return NULL;
 		}
 		free(value);
 		/* Allow -f to set an default From: address though */
 		if(msg->reverse_path)
 		{
 			if(!smtp_set_header (message, "From", NULL, msg->reverse_path))
-				goto failure;
+				return NULL;
 		}
 	}
 	else if(msg->reverse_path)
 	{
 		/* Use reverse path specified at command line. */
 		if(!smtp_set_reverse_path (message, msg->reverse_path))
-			goto failure;
+			return NULL;
 	}
-	else if(identity->address)
+	else if(identity->address && strncmp(identity->address, "*@", 2))
 	{
 		/* Use the identity address as reverse path. */
 		if(!smtp_set_reverse_path (message, identity->address))
-			goto failure;
+			return NULL;
 	}
 	else
 	{
@@ -626,13 +748,13 @@ void smtp_send(message_t *msg, identity_t *identity)
 		*p = '\0';
 		
 		if(!smtp_set_reverse_path (message, reverse_path))
-			goto failure;
+			return NULL;
 		free(reverse_path);
 	}
 
 	/* Open the message file and set the callback to read it. */
 	if(!smtp_set_messagecb (message, message_cb, msg))
-		goto failure;
+		return NULL;
 
 	/* Overwrite Sender:-Header if force sender is specified */
 	if(identity->force_sender)
@@ -643,28 +765,33 @@ void smtp_send(message_t *msg, identity_t *identity)
 		if(!smtp_set_header (message, "Sender", NULL, value))
 		{
 			free(value);
-			goto failure;
+			return NULL;
 		}
 		free(value);
 		if(!smtp_set_header_option (message, "Sender", Hdr_OVERRIDE, (int)1))
-			goto failure;
+			return NULL;
 	}
 
 	/* Prohibit Message-ID:-Header if force_msgid is not specified */
 	if(identity->prohibit_msgid)
 		if(!smtp_set_header_option(message, "Message-ID", Hdr_PROHIBIT, (int)1))
-			goto failure;
+			return NULL;
 
 	/* DSN options */
 	if(!smtp_dsn_set_ret(message, msg->ret))
-		goto failure;
+		return NULL;
 	if(msg->envid)
 		if(!smtp_dsn_set_envid(message, msg->envid))
-			goto failure;
+			return NULL;
 	
 	/* 8bit-MIME */
 	if(!smtp_8bitmime_set_body(message, msg->body))
-		goto failure;
+		return NULL;
+
+	/* SIZE, so that a relay can refuse a too large message before the data */
+	if(declare_size && msg->spool_path)
+		if(!smtp_size_set_estimate(message, msg->size))
+			return NULL;
 
 	/* Add remote message recipients. */
 	list_for_each(ptr, &msg->remote_recipients)
@@ -674,12 +801,12 @@ void smtp_send(message_t *msg, identity_t *identity)
 		assert(entry->address);
 
 		if(!(recipient = smtp_add_recipient (message, entry->address)))
-			goto failure;
+			return NULL;
 		
 		/* Recipient options set here */
 		if (msg->notify != Notify_NOTSET)
 			if(!smtp_dsn_set_notify (recipient, msg->notify))
-				goto failure;
+				return NULL;
 	}
 
 	/* Add local message recipients if qualifydomain is set */
@@ -690,58 +817,163 @@ void smtp_send(message_t *msg, identity_t *identity)
 
 		assert(entry->address);
 
-		qualifiedaddress = xmalloc(strlen(identity->qualifydomain) + strlen(entry->address) + 2);
-		strcpy(qualifiedaddress, entry->address);
-		strcat(qualifiedaddress, "@");
-		strcat(qualifiedaddress, identity->qualifydomain);
-
-		if(!(recipient = smtp_add_recipient (message, qualifiedaddress)))
-			goto failure;
-		free(qualifiedaddress);
+		/* Those naming this host, e.g. root@thishost, are left alone */
+		if (strchr(entry->address, '@'))
+		{
+			if(!(recipient = smtp_add_recipient (message, entry->address)))
+				return NULL;
+		}
+		else
+		{
+			qualifiedaddress = xmalloc(strlen(identity->qualifydomain) + strlen(entry->address) + 2);
+			strcpy(qualifiedaddress, entry->address);
+			strcat(qualifiedaddress, "@");
+			strcat(qualifiedaddress, identity->qualifydomain);
+
+			if(!(recipient = smtp_add_recipient (message, qualifiedaddress)))
+				return NULL;
+			free(qualifiedaddress);
+		}
 
 		/* Recipient options set here */
 		if (msg->notify != Notify_NOTSET)
 			if(!smtp_dsn_set_notify (recipient, msg->notify))
-				goto failure;
+				return NULL;
 	}
 
-	/* Execute pre-connect command if one was specified. */
-	if (identity->preconnect)
+	return message;
+}
+
+/**
+ * Exit status for the transfer status of a message, telling the temporary
+ * failures, including a connection dropped along the way, from the permanent
+ * ones.
+ */
+static int transfer_exit_status(const smtp_status_t *status)
+{
+	switch (status ? status->code / 100 : 0)
 	{
-		int ret, exit_status;
+		case 2:
+			return EX_OK;
 
-		if (verbose)
-			fprintf (stdout, "Executing pre-connect command: %s\n", identity->preconnect);
+		case 5:
+			return EX_UNAVAILABLE;
 
-		ret = system (identity->preconnect);
-		exit_status = WEXITSTATUS(ret);
+		default:
+			return EX_TEMPFAIL;
+	}
+}
 
-		/* Check whether the child process caught a signal meant for us */
-		if (WIFSIGNALED(ret))
-		{
-			int sig = WTERMSIG(ret);
+/**
+ * \name Lingering sessions
+ *
+ * LibESMTP quits once the messages of a session are sent, and has no way to
+ * keep an idle session alive, so a session lingers by adding the next
+ * message from the event reporting that the last one was sent, before
+ * libESMTP moves on.
+ */
+/*@{*/
 
-			if (sig == SIGINT || sig == SIGQUIT)
-			{
-				fprintf (stderr, "Pre-connect command received signal %d\n", sig);
-				exit (EX_SOFTWARE);
-			}
-		}
+/** State of a lingering session */
+struct linger_context {
+	smtp_linger_t *linger;
+	identity_t *identity;
+	smtp_message_t *messages;	/**< the messages the session started with */
+	int n;
+	int *statuses;
+	smtp_message_t last;		/**< last message added to the session */
+	int lingering;			/**< whether next() was called yet */
+
+	/** \name Messages added while lingering */
+	/*@{*/
+	message_t **added;
+	smtp_message_t *added_messages;
+	int nadded;
+	/*@}*/
+};
+
+static void linger_next (smtp_session_t session, smtp_message_t message, linger_context_t *ctx)
+{
+	const smtp_status_t *status;
+	message_t *msg;
+	smtp_message_t added;
+	int i;
 
-		if (ret == -1)
-		{
-			fputs ("Error executing pre-connect command\n", stderr);
-			exit (EX_OSERR);
-		}
+	if (message != ctx->last)
+		return;
 
-		if (exit_status != 0)
-		{
-			fprintf (stderr, "Pre-connect command \"%s\" exited with non-zero status %d\n",
-				 identity->preconnect, exit_status);
-			exit (EX_SOFTWARE);
-		}
+	/* Recycle the session once the server has trouble */
+	status = smtp_message_transfer_status (message);
+	if (!status || status->code / 100 == 4)
+		return;
+
+	if (!ctx->lingering)
+	{
+		for (i = 0; i < ctx->n; i++)
+			ctx->statuses[i] = transfer_exit_status (smtp_message_transfer_status (ctx->messages[i]));
+		ctx->lingering = 1;
 	}
 
+	if (!(msg = ctx->linger->next (ctx->linger->arg)))
+		return;
+
+	if (!(added = smtp_message_add (session, msg, ctx->identity)))
+	{
+		ctx->linger->done (msg, EX_TEMPFAIL, 0, ctx->linger->arg);
+		return;
+	}
+
+	ctx->added = (message_t **)xrealloc(ctx->added, (ctx->nadded + 1) * sizeof(message_t *));
+	ctx->added_messages = (smtp_message_t *)xrealloc(ctx->added_messages, (ctx->nadded + 1) * sizeof(smtp_message_t));
+	ctx->added[ctx->nadded] = msg;
+	ctx->added_messages[ctx->nadded] = added;
+	ctx->nadded++;
+	ctx->last = added;
+}
+
+/** Report the outcome of the messages added while lingering */
+static void linger_done (linger_context_t *ctx)
+{
+	const smtp_status_t *status;
+	int i;
+
+	for (i = 0; i < ctx->nadded; i++)
+	{
+		status = smtp_message_transfer_status (ctx->added_messages[i]);
+		if (status && status->code)
+			ctx->linger->done (ctx->added[i], transfer_exit_status (status), 1, ctx->linger->arg);
+		else
+			ctx->linger->done (ctx->added[i], EX_TEMPFAIL, 0, ctx->linger->arg);
+	}
+
+	free(ctx->added);
+	free(ctx->added_messages);
+}
+
+/*@}*/
+
+void smtp_send(message_t *msg, identity_t *identity)
+{
+	smtp_session_t session;
+	smtp_message_t message;
+	auth_context_t authctx;
+	const smtp_status_t *status;
+
+	/* This program sends only one message at a time.  Create an SMTP
+	 * session.
+	 */
+	auth_client_init ();
+	if(!(session = smtp_session_new (identity, &authctx)))
+		goto failure;
+
+	/* Add a message to the SMTP session. */
+	if(!(message = smtp_message_add (session, msg, identity)))
+		goto failure;
+
+	/* Execute pre-connect command if one was specified. */
+	if (identity->preconnect)
+		connect_command ("pre-connect", identity->preconnect);
+
 	/* Initiate a connection to the SMTP server and transfer the message. */
 	if (!smtp_start_session (session))
 	{
@@ -750,7 +982,7 @@ void smtp_send(message_t *msg, identity_t *identity)
 		fprintf (stderr, "SMTP server problem %s\n",
 				 smtp_strerror (smtp_errno (), buf, sizeof(buf)));
 
-		exit(EX_UNAVAILABLE);
+		exit(EX_TEMPFAIL);
 	}
 
 
@@ -764,7 +996,7 @@ void smtp_send(message_t *msg, identity_t *identity)
 		fprintf (stderr, "%d %s\n", status->code, status->text);
 		smtp_enumerate_recipients (message, print_recipient_status, NULL);
 
-		exit(EX_SOFTWARE);
+		exit(transfer_exit_status (status));
 	}
 
 	if (log_fp)
@@ -777,52 +1009,326 @@ void smtp_send(message_t *msg, identity_t *identity)
 
 	/* Execute post-connect command if one was specified. */
 	if (identity->postconnect)
+		connect_command ("post-connect", identity->postconnect);
+
+	return;
+
+failure:
 	{
-		int ret, exit_status;
+		char buf[128];
 
-		if (verbose)
-			fprintf (stdout, "Executing post-connect command: %s\n", identity->postconnect);
+		fprintf (stderr, "%s\n",
+				 smtp_strerror (smtp_errno (), buf, sizeof(buf)));
 
-		ret = system (identity->postconnect);
-		exit_status = WEXITSTATUS(ret);
+		exit(EX_SOFTWARE);
+	}
+}
 
-		/* Check whether the child process caught a signal meant for us */
-		if (WIFSIGNALED(ret))
-		{
-			int sig = WTERMSIG(ret);
+int smtp_send_batch(message_t **msgs, int n, identity_t *identity, int *statuses,
+                    smtp_linger_t *linger)
+{
+	smtp_session_t session;
+	smtp_message_t *messages;
+	auth_context_t authctx;
+	const smtp_status_t *status;
+	linger_context_t ctx;
+	int i, ret = 0;
 
-			if (sig == SIGINT || sig == SIGQUIT)
-			{
-				fprintf (stderr, "Post-connect command received signal %d\n", sig);
-				exit (EX_SOFTWARE);
-			}
-		}
+	messages = (smtp_message_t *)xmalloc(n * sizeof(smtp_message_t));
 
-		if (ret == -1)
+	authctx = NULL;
+	auth_client_init ();
+	if(!(session = smtp_session_new (identity, &authctx)))
+	{
+		i = n;
+		goto failure;
+	}
+
+	for(i = 0; i < n; i++)
+		if(!(messages[i] = smtp_message_add (session, msgs[i], identity)))
+			goto failure;
+
+	memset(&ctx, 0, sizeof(ctx));
+	if (linger)
+	{
+		ctx.linger = linger;
+		ctx.identity = identity;
+		ctx.messages = messages;
+		ctx.n = n;
+		ctx.statuses = statuses;
+		ctx.last = messages[n - 1];
+		if(!smtp_set_eventcb (session, event_cb, &ctx))
 		{
-			fputs ("Error executing post-connect command\n", stderr);
-			exit (EX_OSERR);
+			i = n;
+			goto failure;
 		}
+	}
+
+	if (identity->preconnect)
+		connect_command ("pre-connect", identity->preconnect);
+
+	/* Initiate a connection to the SMTP server and transfer the messages. */
+	if (!smtp_start_session (session))
+	{
+		char buf[128];
+
+		fprintf (stderr, "SMTP server problem %s\n",
+				 smtp_strerror (smtp_errno (), buf, sizeof(buf)));
 
-		if (exit_status != 0)
+		for(i = 0; i < n; i++)
+			statuses[i] = EX_TEMPFAIL;
+		ret = -1;
+	}
+	else for(i = 0; i < n; i++)
+	{
+		/* Report on the success or otherwise of each transfer. */
+		status = smtp_message_transfer_status (messages[i]);
+		if((statuses[i] = transfer_exit_status (status)) != EX_OK && status)
 		{
-			fprintf (stderr, "Post-connect command \"%s\" exited with non-zero status %d\n",
-				 identity->postconnect, exit_status);
-			exit (EX_SOFTWARE);
+			fprintf (stderr, "%d %s\n", status->code, status->text);
+			smtp_enumerate_recipients (messages[i], print_recipient_status, NULL);
 		}
 	}
 
-	return;
+	if (linger)
+		linger_done (&ctx);
+
+	if (log_fp)
+		fputc('\n', log_fp);
+
+	smtp_destroy_session (session);
+	if(authctx)
+		auth_destroy_context (authctx);
+	auth_client_exit ();
+
+	free(messages);
+
+	if (identity->postconnect)
+		connect_command ("post-connect", identity->postconnect);
+
+	return ret;
 
 failure:
 	{
 		char buf[128];
+		message_t **rest;
+		int j, k, *rest_statuses;
 
 		fprintf (stderr, "%s\n",
 				 smtp_strerror (smtp_errno (), buf, sizeof(buf)));
 
-		exit(EX_SOFTWARE);
+		if(session)
+			smtp_destroy_session (session);
+		if(authctx)
+			auth_destroy_context (authctx);
+		auth_client_exit ();
+
+		free(messages);
+
+		/* Nothing could be sent in this session */
+		if(i == n)
+		{
+			for(i = 0; i < n; i++)
+				statuses[i] = EX_SOFTWARE;
+			return 0;
+		}
+
+		/* Only the message that couldn't be added fails, the others are
+		 * sent in a session of their own, without lingering.
+		 */
+		statuses[i] = EX_SOFTWARE;
+		if(n == 1)
+			return 0;
+
+		rest = (message_t **)xmalloc((n - 1) * sizeof(message_t *));
+		rest_statuses = (int *)xmalloc((n - 1) * sizeof(int));
+		for(j = k = 0; j < n; j++)
+			if(j != i)
+				rest[k++] = msgs[j];
+
+		ret = smtp_send_batch (rest, n - 1, identity, rest_statuses, NULL);
+
+		for(j = k = 0; j < n; j++)
+			if(j != i)
+				statuses[j] = rest_statuses[k++];
+
+		free(rest_statuses);
+		free(rest);
+
+		return ret;
+	}
+}
+
+/*@}*/
+
+
+/**
+ * \name Routing
+ */
+/*@{*/
+
+/** Recipients of a message delivered via the same identity */
+typedef struct {
+	identity_t *identity;
+	struct list_head recipients;
+	pid_t pid;
+} route_group_t;
+
+/**
+ * Mark the recipients handed to a relay as delivered, along with the local
+ * ones if they were qualified for it.
+ */
+static void smtp_delivered(message_t *msg, struct list_head *recipients, int qualified)
+{
+	struct list_head *ptr;
+
+	list_for_each(ptr, recipients)
+		list_entry(ptr, recipient_t, list)->delivered = 1;
+
+	if(qualified)
+		list_for_each(ptr, &msg->local_recipients)
+			list_entry(ptr, recipient_t, list)->delivered = 1;
+}
+
+int smtp_send_routed(message_t *msg, identity_t *identity)
+{
+	route_group_t *groups;
+	struct list_head *ptr, *tmp;
+	int ngroups = 0, i, ret = EX_OK;
+
+	if(list_empty(&routes) || list_empty(&msg->remote_recipients))
+	{
+		smtp_send(msg, identity);
+		smtp_delivered(msg, &msg->remote_recipients, identity->qualifydomain != NULL);
+		return EX_OK;
 	}
+
+	/* There can't be more groups than routes plus the sender identity */
+	i = 1;
+	list_for_each(ptr, &routes)
+		i++;
+	groups = (route_group_t *)xmalloc(i * sizeof(route_group_t));
+
+	/* The sender identity always gets the first group, as the recipients
+	 * qualified by its qualifydomain go with it */
+	groups[ngroups].identity = identity;
+	INIT_LIST_HEAD(&groups[ngroups].recipients);
+	ngroups++;
+
+	list_for_each_safe(ptr, tmp, &msg->remote_recipients)
+	{
+		recipient_t *recipient = list_entry(ptr, recipient_t, list);
+		identity_t *route;
+
+		if(!(route = route_lookup(recipient->address)))
+			route = identity;
+
+		for(i = 0; i < ngroups && groups[i].identity != route; i++)
+			;
+		if(i == ngroups)
+		{
+			groups[ngroups].identity = route;
+			INIT_LIST_HEAD(&groups[ngroups].recipients);
+			ngroups++;
+		}
+
+		list_move_tail(ptr, &groups[i].recipients);
+	}
+
+	/* Drop the sender identity's group if it has nothing to deliver */
+	if(list_empty(&groups[0].recipients) && !(identity->qualifydomain && !list_empty(&msg->local_recipients)))
+	{
+		ngroups--;
+		groups[0].identity = groups[ngroups].identity;
+		list_splice(&groups[ngroups].recipients, &groups[0].recipients);
+	}
+
+	if(ngroups == 1)
+	{
+		struct list_head local;
+
+		/* No need for a spool */
+		list_splice(&groups[0].recipients, &msg->remote_recipients);
+
+		/* The local ones are only qualified by the sender identity, as
+		 * in the children below */
+		INIT_LIST_HEAD(&local);
+		if(groups[0].identity != identity)
+			list_splice_init(&msg->local_recipients, &local);
+
+		smtp_send(msg, groups[0].identity);
+		smtp_delivered(msg, &msg->remote_recipients,
+		               groups[0].identity == identity && identity->qualifydomain);
+
+		list_splice(&local, &msg->local_recipients);
+		free(groups);
+		return EX_OK;
+	}
+
+	message_spool(msg);
+
+	/* Don't let the children flush our buffers, e.g. of the MDA pipe */
+	fflush(NULL);
+
+	for(i = 0; i < ngroups; i++)
+	{
+		if((groups[i].pid = fork()) < 0)
+		{
+			perror("fork");
+			exit(EX_OSERR);
+		}
+
+		if(groups[i].pid == 0)
+		{
+			/* Deliver just this group */
+			mda_fp = NULL;
+			message_reopen(msg);
+
+			INIT_LIST_HEAD(&msg->remote_recipients);
+			list_splice(&groups[i].recipients, &msg->remote_recipients);
+			if(groups[i].identity != identity)
+				INIT_LIST_HEAD(&msg->local_recipients);
+
+			if(verbose)
+				fprintf(stdout, "Delivering via %s\n",
+					groups[i].identity->host ? groups[i].identity->host : "localhost:25");
+
+			smtp_send(msg, groups[i].identity);
+
+			fflush(NULL);
+			_exit(EX_OK);
+		}
+	}
+
+	/* Collect the statuses, reporting the first failure */
+	for(i = 0; i < ngroups; i++)
+	{
+		int status;
+
+		while(waitpid(groups[i].pid, &status, 0) < 0)
+			if(errno != EINTR)
+			{
+				perror("waitpid");
+				exit(EX_OSERR);
+			}
+
+		status = WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+		/* the sender identity's group took the local ones along */
+		if(status == EX_OK)
+			smtp_delivered(msg, &groups[i].recipients,
+			               groups[i].identity == identity && identity->qualifydomain);
+		else if(ret == EX_OK)
+			ret = status;
+
+		/* Give the recipients back to the message */
+		list_splice(&groups[i].recipients, &msg->remote_recipients);
+	}
+
+	free(groups);
+
+	message_reopen(msg);
+
+	return ret;
 }
 
 /*@}*/
@@ -25,6 +25,8 @@ typedef struct {
 	
 	char *address;	/**< reverse path address */
 
+	char *route;	/**< recipient domain pattern, for routes */
+
 	char *host;	/**< hostname and service (port) */
 
 	/** \name Auth extension */
@@ -55,6 +57,21 @@ typedef struct {
 	char *force_sender;
 	int prohibit_msgid;
 	/*@}*/
+
+	enum priority priority;	/**< priority of the messages queued, if not given */
+
+	/** \name Rate limits, zero for none */
+	/*@{*/
+	int messages_per_minute;
+	int recipients_per_hour;
+	/*@}*/
+
+	/** \name Lingering sessions of persistent queue runs */
+	/*@{*/
+	int sessions;		/**< most sessions lingering at once, zero for none */
+	int session_idle;	/**< seconds a session lingers idle, zero for the default */
+	int session_messages;	/**< messages before quitting, zero for the default */
+	/*@}*/
 } identity_t;
 
 /** 
@@ -62,6 +79,16 @@ typedef struct {
  */
 extern identity_t *default_identity;
 
+/**
+ * All identities, most recently added first.
+ */
+extern struct list_head identities;
+
+/**
+ * All routes, most recently added first.
+ */
+extern struct list_head routes;
+
 /** Create a new identity */
 identity_t *identity_new(void);
 
@@ -71,6 +98,17 @@ void identity_add(identity_t *identity);
 /** Lookup a identity */
 identity_t *identity_lookup(const char *address);
 
+/**
+ * Add a route.
+ *
+ * A route is an identity used to deliver to the recipients in the domains
+ * matching \p pattern, instead of the identity selected by the sender.
+ */
+void route_add(identity_t *identity, const char *pattern);
+
+/** Lookup the route for a recipient, returning NULL if none matches */
+identity_t *route_lookup(const char *address);
+
 /** Initialize the identities resources */
 void identities_init(void);
 
@@ -80,7 +118,57 @@ void identities_cleanup(void);
 /*@}*/
 
 
+/** Size of the chunks in which the message is handed to libESMTP */
+extern int chunk_size;
+
 /** Send a message via a SMTP server */
 void smtp_send(message_t *msg, identity_t *identity);
 
+/**
+ * Source of more messages for a session to send once done with those it
+ * started with, so that it lingers instead of quitting.
+ */
+typedef struct {
+	/**
+	 * Wait for another message to send, returning NULL to quit.  The
+	 * statuses of the messages the session started with are set by then.
+	 */
+	message_t *(*next)(void *arg);
+
+	/**
+	 * Outcome of a message got from next(), as for smtp_send_batch(), or
+	 * EX_TEMPFAIL if the session ended before it was \p tried.
+	 */
+	void (*done)(message_t *message, int status, int tried, void *arg);
+
+	void *arg;
+} smtp_linger_t;
+
+/**
+ * Send several messages via a SMTP server, in a single session.
+ *
+ * Unlike smtp_send(), failures don't exit but are reported for each message,
+ * in \p statuses, as EX_TEMPFAIL if they are worth retrying.  The messages
+ * must have no recipients for other routes.
+ *
+ * \param linger if given, where to get more messages from once these are
+ * sent, as long as the server accepts them.
+ *
+ * \return -1 if the server couldn't be reached, 0 otherwise.
+ */
+int smtp_send_batch(message_t **msgs, int n, identity_t *identity, int *statuses,
+                    smtp_linger_t *linger);
+
+/**
+ * Send a message, splitting its remote recipients according to the routes.
+ *
+ * Each group of recipients is delivered by a separate process, in parallel,
+ * with \p identity used for those not matching any route.  The recipients
+ * of the groups delivered are marked as such.
+ *
+ * \return the status of the first group which failed, or EX_OK.  With a
+ * single group, failures exit as with smtp_send().
+ */
+int smtp_send_routed(message_t *msg, identity_t *identity);
+
 #endif